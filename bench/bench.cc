@@ -0,0 +1,276 @@
+/*
+ *  Copyright (C) 2019 Zachary Mohling
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <string>
+#include <vector>
+
+#include "bench.h"
+#include "cipher.h"
+#include "cpu_limits.h"
+#include "engine.h"
+#include "modes.h"
+#include "session.h"
+
+/* Most blocks per call of the openssl suite, which OpenSSL takes as an *
+ * int count of bytes                                                  */
+#define MAX_OPENSSL_BLOCKS (64 * 1024 * 1024)
+
+#define USAGE                                                               \
+  "Usage: tdes-bench [options]\n"                                           \
+  "  --suite S           micro, pipeline, openssl or all, all by default\n" \
+  "  --format F          json or csv, json by default\n"                    \
+  "  --output FILE       write the results to FILE instead of stdout\n"     \
+  "  --sizes N[K|M],...  file sizes of the pipeline suite\n"                \
+  "  --chunks N[K|M],... chunk sizes of the pipeline suite\n"               \
+  "  --workers N,...     worker counts of the pipeline and openssl\n"       \
+  "  --block-mode M      ecb, ctr or cbc for the pipeline suite\n"          \
+  "  --mmap              map the files in the pipeline suite\n"             \
+  "  --engine NAME       engine of the sessions, the fastest by default\n"  \
+  "  --blocks N[K|M],... block counts of the openssl suite\n"               \
+  "  --min-time SECONDS  shortest trial, 0.2 by default\n"                  \
+  "  --trials N          trials per measurement, median kept, 5 by default\n"
+
+/* Parse a comma-separated list of counts, each with an optional K, M or *
+ * G suffix. Exits on anything that is not a whole number in [min, max]. */
+static std::vector<uint64_t> parse_list(const char *option, const char *value,
+                                        uint64_t min, uint64_t max) {
+  std::vector<uint64_t> list;
+
+  const char *item = value;
+  for (;;) {
+    char *end;
+    errno = 0;
+    uint64_t size = strtoull(item, &end, 10);
+
+    if (*end == 'K' || *end == 'k') {
+      size *= 1024, end++;
+    } else if (*end == 'M' || *end == 'm') {
+      size *= 1024 * 1024, end++;
+    } else if (*end == 'G' || *end == 'g') {
+      size *= 1024 * 1024 * 1024, end++;
+    }
+
+    if (errno != 0 || end == item || (*end != '\0' && *end != ',') ||
+        size < min || size > max) {
+      fprintf(stderr, "Invalid value for %s: %s\n", option, value);
+      exit(-2);
+    }
+
+    list.push_back(size);
+    if (*end == '\0') return list;
+    item = end + 1;
+  }
+}
+
+/* 1, 2, 4, ... up to and including cpus */
+static std::vector<unsigned> default_worker_counts(unsigned cpus) {
+  std::vector<unsigned> counts;
+  unsigned count;
+  for (count = 1; count < cpus; count *= 2) counts.push_back(count);
+  counts.push_back(cpus);
+  return counts;
+}
+
+/* JSON and CSV forms of bench_result::matches, indexed by matches + 1 */
+static const char *MATCHES[] = {"null", "false", "true"};
+static const char *MATCHES_CSV[] = {"", "0", "1"};
+
+static double per_second(double value, double seconds) {
+  return seconds > 0 ? value / seconds : 0;
+}
+
+static void write_json(FILE *out, const std::vector<bench_result> &results,
+                       unsigned cpus) {
+  fprintf(out, "{\n");
+  fprintf(out, "  \"cpus\": %u,\n", cpus);
+  fprintf(out, "  \"default_engine\": \"%s\",\n", engine_default()->name);
+  fprintf(out, "  \"cycle_counter\": %s,\n",
+          bench_cycles() ? "\"tsc\"" : "null");
+  fprintf(out, "  \"results\": [\n");
+
+  size_t i;
+  for (i = 0; i < results.size(); i++) {
+    const bench_result &r = results[i];
+
+    fprintf(out,
+            "    {\"suite\": \"%s\", \"name\": \"%s\", \"file_size\": %llu, "
+            "\"chunk_size\": %llu, \"workers\": %u, \"bytes\": %llu, "
+            "\"seconds\": %.9g, \"bytes_per_second\": %.6g, "
+            "\"cycles_per_byte\": %.4g, \"speedup\": %.4g, "
+            "\"efficiency\": %.4g, \"matches\": %s, \"relative\": %.4g}%s\n",
+            r.suite.c_str(), r.name.c_str(), (unsigned long long)r.file_size,
+            (unsigned long long)r.chunk_size, r.workers,
+            (unsigned long long)r.bytes, r.seconds,
+            per_second(r.bytes, r.seconds), r.bytes ? r.cycles / r.bytes : 0,
+            r.speedup, r.workers ? r.speedup / r.workers : 0,
+            MATCHES[r.matches + 1], r.relative,
+            i + 1 < results.size() ? "," : "");
+  }
+
+  fprintf(out, "  ]\n}\n");
+}
+
+static void write_csv(FILE *out, const std::vector<bench_result> &results) {
+  fprintf(out,
+          "suite,name,file_size,chunk_size,workers,bytes,seconds,"
+          "bytes_per_second,cycles_per_byte,speedup,efficiency,matches,"
+          "relative\n");
+
+  size_t i;
+  for (i = 0; i < results.size(); i++) {
+    const bench_result &r = results[i];
+
+    fprintf(out, "%s,%s,%llu,%llu,%u,%llu,%.9g,%.6g,%.4g,%.4g,%.4g,%s,%.4g\n",
+            r.suite.c_str(), r.name.c_str(), (unsigned long long)r.file_size,
+            (unsigned long long)r.chunk_size, r.workers,
+            (unsigned long long)r.bytes, r.seconds,
+            per_second(r.bytes, r.seconds), r.bytes ? r.cycles / r.bytes : 0,
+            r.speedup, r.workers ? r.speedup / r.workers : 0,
+            MATCHES_CSV[r.matches + 1], r.relative);
+  }
+}
+
+int main(int argc, char *argv[]) {
+  unsigned cpus = available_cpus();
+
+  bench_options options;
+  options.min_time = 0.2;
+  options.trials = 5;
+  options.block_mode = BLOCK_MODE_ECB;
+  options.map_files = false;
+  options.engine = NULL;
+  options.file_sizes = {64 * 1024, 1024 * 1024, 16 * 1024 * 1024};
+  options.chunk_sizes = {16 * 1024, 64 * 1024, 1024 * 1024};
+  options.worker_counts = default_worker_counts(cpus);
+  options.block_counts = {1, 64, 4096, 65536, 1024 * 1024};
+
+  std::string suite = "all", format = "json", output;
+
+  int i;
+  for (i = 1; i < argc; i++) {
+    std::string arg(argv[i]);
+    bool has_value = (i + 1 < argc);
+
+    if (arg == "--suite" && has_value) {
+      suite = argv[++i];
+      if (suite != "micro" && suite != "pipeline" && suite != "openssl" &&
+          suite != "all") {
+        fprintf(stderr, "Invalid value for --suite: %s\n", suite.c_str());
+        return -2;
+      }
+    } else if (arg == "--format" && has_value) {
+      format = argv[++i];
+      if (format != "json" && format != "csv") {
+        fprintf(stderr, "Invalid value for --format: %s\n", format.c_str());
+        return -2;
+      }
+    } else if (arg == "--output" && has_value) {
+      output = argv[++i];
+    } else if (arg == "--sizes" && has_value) {
+      options.file_sizes = parse_list(argv[i], argv[i + 1], 0, UINT64_MAX);
+      i++;
+    } else if (arg == "--chunks" && has_value) {
+      options.chunk_sizes =
+          parse_list(argv[i], argv[i + 1], BLOCK_SIZE, MAX_CHUNK_SIZE);
+      i++;
+    } else if (arg == "--workers" && has_value) {
+      std::vector<uint64_t> counts = parse_list(argv[i], argv[i + 1], 1, 1024);
+      options.worker_counts.assign(counts.begin(), counts.end());
+      i++;
+    } else if (arg == "--block-mode" && has_value) {
+      std::string value(argv[++i]);
+      if (value == "ecb") {
+        options.block_mode = BLOCK_MODE_ECB;
+      } else if (value == "ctr") {
+        options.block_mode = BLOCK_MODE_CTR;
+      } else if (value == "cbc") {
+        options.block_mode = BLOCK_MODE_CBC;
+      } else {
+        fprintf(stderr, "Invalid value for --block-mode: %s\n", value.c_str());
+        return -2;
+      }
+    } else if (arg == "--blocks" && has_value) {
+      options.block_counts =
+          parse_list(argv[i], argv[i + 1], 1, MAX_OPENSSL_BLOCKS);
+      i++;
+    } else if (arg == "--engine" && has_value) {
+      options.engine = engine_find(argv[++i]);
+      if (!options.engine || !options.engine->supported()) {
+        fprintf(stderr, "Invalid value for --engine: %s\n", argv[i]);
+        return -2;
+      }
+    } else if (arg == "--mmap") {
+      options.map_files = true;
+    } else if (arg == "--min-time" && has_value) {
+      options.min_time = atof(argv[++i]);
+    } else if (arg == "--trials" && has_value) {
+      options.trials = parse_list(argv[i], argv[i + 1], 1, 1000)[0];
+      i++;
+    } else {
+      fprintf(stderr, USAGE);
+      return -2;
+    }
+  }
+
+  size_t c;
+  for (c = 0; c < options.chunk_sizes.size(); c++) {
+    if (options.chunk_sizes[c] % BLOCK_SIZE != 0) {
+      fprintf(stderr, "--chunks must be multiples of %d\n", BLOCK_SIZE);
+      return -2;
+    }
+  }
+
+  if (!permutation_tables_match()) {
+    fprintf(stderr, "Permutation tables differ from permute().\n");
+    return 1;
+  }
+
+  std::vector<bench_result> results;
+  if (suite == "micro" || suite == "all") run_micro(&options, &results);
+  if (suite == "pipeline" || suite == "all") run_pipeline(&options, &results);
+
+  bool conforms = true;
+  if (suite == "openssl" || suite == "all") {
+    conforms = run_openssl(&options, &results);
+  }
+
+  FILE *out = stdout;
+  if (!output.empty() && !(out = fopen(output.c_str(), "w"))) {
+    fprintf(stderr, "Could not open file %s. ERROR: %d\n", output.c_str(),
+            errno);
+    return -1;
+  }
+
+  if (format == "json")
+    write_json(out, results, cpus);
+  else
+    write_csv(out, results);
+
+  if (out != stdout) fclose(out);
+
+  if (!conforms) {
+    fprintf(stderr, "Output differs from OpenSSL DES-EDE3. See matches.\n");
+    return 1;
+  }
+
+  return 0;
+}
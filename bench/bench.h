@@ -0,0 +1,148 @@
+/*
+ *  Copyright (C) 2019 Zachary Mohling
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef BENCH_H_
+#define BENCH_H_
+
+#include <stdint.h>
+
+#include <algorithm>
+#include <chrono>
+#include <string>
+#include <vector>
+
+#include "engine.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+/* Settings of a benchmark run, from the command line. Every timed      *
+ * measurement is the median of trials trials, each running for at      *
+ * least min_time seconds. The pipeline suite runs every combination of *
+ * file_sizes, chunk_sizes and worker_counts, the openssl suite every   *
+ * combination of block_counts and worker_counts.                       */
+typedef struct bench_options {
+  double min_time;
+  unsigned trials;
+  int block_mode;
+  bool map_files;
+  std::vector<uint64_t> file_sizes;
+  std::vector<uint64_t> chunk_sizes;
+  std::vector<unsigned> worker_counts;
+  std::vector<uint64_t> block_counts;
+  const tdes_engine *engine;
+} bench_options;
+
+/* One measurement. suite names the group of benchmarks and name what   *
+ * was timed. bytes is the input processed per trial, and seconds and   *
+ * cycles what the median trial took; cycles is 0 where there is no     *
+ * cycle counter. Pipeline rows also carry their geometry, and speedup  *
+ * over the fewest workers at the same geometry; others leave them 0.   *
+ *                                                                      *
+ * openssl rows carry the bytes per call in file_size. matches is 1 if  *
+ * the output agreed with OpenSSL bit for bit, 0 if not, and -1 where   *
+ * nothing was compared; relative is the throughput over OpenSSL's at   *
+ * the same block and worker count, 0 where nothing was compared.       */
+typedef struct bench_result {
+  std::string suite;
+  std::string name;
+  uint64_t file_size;
+  uint64_t chunk_size;
+  unsigned workers;
+  uint64_t bytes;
+  double seconds;
+  double cycles;
+  double speedup;
+  int matches;
+  double relative;
+} bench_result;
+
+/* Time of one trial */
+typedef struct bench_sample {
+  double seconds;
+  double cycles;
+} bench_sample;
+
+/* Reference cycles elapsed, from the time stamp counter where the host *
+ * has one, 0 otherwise.                                                */
+inline uint64_t bench_cycles() {
+#if defined(__x86_64__) || defined(__i386__)
+  return __rdtsc();
+#else
+  return 0;
+#endif
+}
+
+/* Median trial of fn, which is called as fn(iterations) and runs the  *
+ * timed operation that many times. The iteration count is doubled     *
+ * until one call lasts min_time, then held for every trial; the       *
+ * count used is stored in iterations.                                 */
+template <class F>
+bench_sample bench_measure(F fn, const bench_options *options,
+                           uint64_t *iterations) {
+  typedef std::chrono::steady_clock clock;
+
+  uint64_t count = 1;
+  for (;;) {
+    clock::time_point start = clock::now();
+    fn(count);
+    double seconds =
+        std::chrono::duration<double>(clock::now() - start).count();
+    if (seconds >= options->min_time || count >= (UINT64_C(1) << 40)) break;
+    count *= 2;
+  }
+
+  std::vector<bench_sample> samples;
+  unsigned trial;
+  for (trial = 0; trial < std::max(options->trials, 1u); trial++) {
+    uint64_t start_cycles = bench_cycles();
+    clock::time_point start = clock::now();
+    fn(count);
+    bench_sample sample;
+    sample.seconds =
+        std::chrono::duration<double>(clock::now() - start).count();
+    sample.cycles = (double)(bench_cycles() - start_cycles);
+    samples.push_back(sample);
+  }
+
+  std::sort(samples.begin(), samples.end(),
+            [](const bench_sample &a, const bench_sample &b) {
+              return a.seconds < b.seconds;
+            });
+
+  *iterations = count;
+  return samples[samples.size() / 2];
+}
+
+/* Microbenchmarks of the single-block primitives and of the bulk       *
+ * engines over a buffer that stays in cache.                           */
+void run_micro(const bench_options *options,
+               std::vector<bench_result> *results);
+
+/* End-to-end throughput of whole files through a Session, the path    *
+ * run() takes, over generated data in the temporary directory.        */
+void run_pipeline(const bench_options *options,
+                  std::vector<bench_result> *results);
+
+/* Conformance and relative throughput against OpenSSL's DES-EDE3 in    *
+ * ECB mode, under the raw K1, K2 and K3 of a PBKDF2-derived key.       *
+ * Returns false if any engine disagreed with OpenSSL.                  */
+bool run_openssl(const bench_options *options,
+                 std::vector<bench_result> *results);
+
+#endif  // BENCH_H_
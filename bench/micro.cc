@@ -0,0 +1,189 @@
+/*
+ *  Copyright (C) 2019 Zachary Mohling
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include <string.h>
+
+#include <string>
+#include <vector>
+
+#include "bench.h"
+#include "cipher.h"
+#include "engine.h"
+#include "key_generator.h"
+#include "session.h"
+
+/* Blocks per call of the bulk engines: 32 KB, which stays in L1 or L2 */
+#define BULK_BLOCKS 4096
+
+/* Key sets per call of the batch key expansion */
+#define REKEY_SETS 16
+
+/* Key the microbenchmarks run under */
+static const uint8_t BENCH_KEY[24] = {
+    0x01, 0x23, 0x45, 0x67, 0x89, 0xAB, 0xCD, 0xEF, 0x23, 0x45, 0x67, 0x89,
+    0xAB, 0xCD, 0xEF, 0x01, 0x45, 0x67, 0x89, 0xAB, 0xCD, 0xEF, 0x01, 0x23};
+
+/* Written with the last output of every benchmark, so that none of the *
+ * timed work can be optimized away                                     */
+static volatile uint8_t sink;
+
+/* Time fn, which processes bytes_per_call bytes per iteration, and     *
+ * record it as micro benchmark name.                                   */
+template <class F>
+static void micro(const char *name, uint64_t bytes_per_call, F fn,
+                  const bench_options *options,
+                  std::vector<bench_result> *results) {
+  uint64_t iterations;
+  bench_sample sample = bench_measure(fn, options, &iterations);
+
+  bench_result result = {"micro", name, 0, 0, 1,
+                         iterations * bytes_per_call, sample.seconds,
+                         sample.cycles, 0, -1, 0};
+  results->push_back(result);
+}
+
+void run_micro(const bench_options *options,
+               std::vector<bench_result> *results) {
+  key_schedule K1, K2, K3;
+  Session::expand_key(BENCH_KEY, &K1, &K2, &K3);
+
+  Cipher reference(Cipher::ENGINE_REFERENCE), table(Cipher::ENGINE_TABLE);
+  KeyGenerator keygen;
+
+  /* Each single-block benchmark feeds its output back in as the next   *
+   * input, so the iterations form one dependency chain.                */
+  uint8_t block[2][BLOCK_SIZE] = {{0}};
+
+  micro("cipher_encrypt_reference", BLOCK_SIZE, [&](uint64_t n) {
+    uint64_t i;
+    for (i = 0; i < n; i++) reference.encrypt(block[~i & 1], block[i & 1], &K1);
+    sink = block[0][0];
+  }, options, results);
+
+  micro("cipher_decrypt_reference", BLOCK_SIZE, [&](uint64_t n) {
+    uint64_t i;
+    for (i = 0; i < n; i++) reference.decrypt(block[~i & 1], block[i & 1], &K1);
+    sink = block[0][0];
+  }, options, results);
+
+  micro("cipher_encrypt_table", BLOCK_SIZE, [&](uint64_t n) {
+    uint64_t i;
+    for (i = 0; i < n; i++) table.encrypt(block[~i & 1], block[i & 1], &K1);
+    sink = block[0][0];
+  }, options, results);
+
+  micro("cipher_decrypt_table", BLOCK_SIZE, [&](uint64_t n) {
+    uint64_t i;
+    for (i = 0; i < n; i++) table.decrypt(block[~i & 1], block[i & 1], &K1);
+    sink = block[0][0];
+  }, options, results);
+
+  micro("permute_ip", BLOCK_SIZE, [&](uint64_t n) {
+    uint64_t i;
+    for (i = 0; i < n; i++) {
+      permute(BLOCK_SIZE, BLOCK_SIZE, block[i & 1], block[~i & 1], IP);
+    }
+    sink = block[0][0];
+  }, options, results);
+
+  uint8_t expanded[EXPANSION_SIZE] = {0x12, 0x34, 0x56, 0x78, 0x9A, 0xBC};
+  uint8_t substituted[BLOCK_SIZE / 2];
+
+  micro("substitute", EXPANSION_SIZE, [&](uint64_t n) {
+    uint64_t i;
+    for (i = 0; i < n; i++) {
+      reference.substitute(expanded, substituted);
+      expanded[i % EXPANSION_SIZE] ^= substituted[i % (BLOCK_SIZE / 2)];
+    }
+    sink = expanded[0];
+  }, options, results);
+
+  uint8_t key[KEY_SIZE];
+  uint8_t round_keys[NUM_ROUNDS][SUBKEY_SIZE];
+  memcpy(key, BENCH_KEY, KEY_SIZE);
+
+  micro("key_generator_generate", KEY_SIZE, [&](uint64_t n) {
+    uint64_t i;
+    for (i = 0; i < n; i++) {
+      keygen.generate(key, round_keys);
+      key[i % KEY_SIZE] ^= round_keys[NUM_ROUNDS - 1][i % SUBKEY_SIZE];
+    }
+    sink = key[0];
+  }, options, results);
+
+  key_schedule schedule;
+
+  micro("key_generator_expand", KEY_SIZE, [&](uint64_t n) {
+    uint64_t i;
+    for (i = 0; i < n; i++) {
+      KeyGenerator::expand(key, &schedule);
+      key[i % KEY_SIZE] ^= schedule.sub_keys[NUM_ROUNDS - 1][i % SUBKEY_SIZE];
+    }
+    sink = key[0];
+  }, options, results);
+
+  /* Rekeying, a batch of key sets per call, for every engine at once *
+   * and for the table engine alone, which needs no bitslice masks     */
+  static uint8_t key_sets[REKEY_SETS][3 * KEY_SIZE];
+  static engine_keys rekeyed[REKEY_SETS];
+  for (size_t set = 0; set < REKEY_SETS; set++) {
+    memcpy(key_sets[set], BENCH_KEY, sizeof(key_sets[set]));
+    key_sets[set][0] ^= set;
+  }
+
+  const tdes_engine *rekey_engines[] = {NULL, engine_find("table")};
+  const char *rekey_names[] = {"engine_expand_keys",
+                               "engine_expand_keys_table"};
+  size_t r;
+  for (r = 0; r < 2; r++) {
+    const tdes_engine *rekey_engine = rekey_engines[r];
+
+    micro(rekey_names[r], sizeof(key_sets), [&](uint64_t n) {
+      uint64_t i;
+      for (i = 0; i < n; i++) {
+        engine_expand_keys(key_sets[0], REKEY_SETS, rekey_engine, rekeyed);
+        key_sets[i % REKEY_SETS][0] ^= rekeyed[0].schedules[2].sub_keys[0][0];
+      }
+      sink = key_sets[0][0];
+    }, options, results);
+  }
+
+  /* Bulk Triple DES through every engine the host supports, the work *
+   * items of the pipeline                                            */
+  std::vector<uint8_t> buffer(BULK_BLOCKS * BLOCK_SIZE, 0x5A);
+  uint8_t *data = buffer.data();
+
+  static engine_keys keys;
+  engine_load_keys(&K1, &K2, &K3, NULL, &keys);
+
+  size_t num_engines, e;
+  const tdes_engine *engines = engine_list(&num_engines);
+  for (e = 0; e < num_engines; e++) {
+    const tdes_engine *engine = &engines[e];
+    if (!engine->supported()) continue;
+
+    std::string name = std::string("triple_encrypt_blocks_") + engine->name;
+
+    micro(name.c_str(), BULK_BLOCKS * BLOCK_SIZE, [&](uint64_t n) {
+      uint64_t i;
+      for (i = 0; i < n; i++) {
+        engine->crypt(data, data, BULK_BLOCKS, &keys, false);
+      }
+      sink = data[0];
+    }, options, results);
+  }
+}
@@ -0,0 +1,261 @@
+/*
+ *  Copyright (C) 2019 Zachary Mohling
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include <openssl/crypto.h>
+#include <openssl/evp.h>
+#include <string.h>
+
+#include <atomic>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "../lib/ThreadPool.h"
+#include "bench.h"
+#include "cipher.h"
+#include "engine.h"
+#include "modes.h"
+#include "session.h"
+
+/* Password the key is derived from, as init_keys derives it */
+#define BENCH_PASSWORD "tdes-bench"
+
+/* Most blocks run through the reference engine, which is slow enough *
+ * to dominate the suite beyond this                                  */
+#define MAX_REFERENCE_BLOCKS 4096
+
+/* OpenSSL's DES-EDE3 in ECB mode, one context per worker, each taking *
+ * an equal run of the blocks on its own pool thread.                  */
+class OpensslEde3 {
+ public:
+  OpensslEde3(const uint8_t key[24], unsigned num_workers, bool padding)
+      : pool_(num_workers), contexts_(num_workers) {
+    size_t i;
+    for (i = 0; i < contexts_.size(); i++) {
+      contexts_[i] = EVP_CIPHER_CTX_new();
+      if (!contexts_[i] ||
+          EVP_EncryptInit_ex(contexts_[i], EVP_des_ede3_ecb(), NULL, key,
+                             NULL) != 1) {
+        fprintf(stderr, "Could not set up OpenSSL DES-EDE3.\n");
+        exit(-1);
+      }
+      EVP_CIPHER_CTX_set_padding(contexts_[i], padding ? 1 : 0);
+    }
+  }
+
+  ~OpensslEde3() {
+    size_t i;
+    for (i = 0; i < contexts_.size(); i++) EVP_CIPHER_CTX_free(contexts_[i]);
+  }
+
+  /* Encrypt num_blocks blocks, and with padding the block after them */
+  void encrypt(uint8_t *out, const uint8_t *in, uint64_t num_blocks) {
+    uint64_t num_items = std::min((uint64_t)contexts_.size(), num_blocks);
+    if (num_items <= 1) {
+      encrypt_item(out, in, num_blocks, 0, true);
+      return;
+    }
+
+    uint64_t blocks_per_item = (num_blocks - 1) / num_items + 1;
+    std::atomic<uint64_t> num_completed(0);
+
+    pool_.submit_bulk(num_items, [&](size_t item) {
+      uint64_t first = item * blocks_per_item;
+      uint64_t count = std::min(blocks_per_item, num_blocks - first);
+      encrypt_item(out + first * BLOCK_SIZE, in + first * BLOCK_SIZE, count,
+                   item, item == num_items - 1);
+      num_completed.fetch_add(1, std::memory_order_release);
+    });
+
+    while (num_completed.load(std::memory_order_acquire) < num_items) {
+      std::this_thread::yield();
+    }
+  }
+
+ private:
+  ThreadPool pool_;
+  std::vector<EVP_CIPHER_CTX *> contexts_;
+
+  void encrypt_item(uint8_t *out, const uint8_t *in, uint64_t num_blocks,
+                    size_t context, bool last) {
+    EVP_CIPHER_CTX *ctx = contexts_[context];
+    int length;
+
+    if (EVP_EncryptUpdate(ctx, out, &length, in, num_blocks * BLOCK_SIZE) !=
+            1 ||
+        (last && EVP_EncryptFinal_ex(ctx, out + length, &length) != 1)) {
+      fprintf(stderr, "OpenSSL DES-EDE3 failed.\n");
+      exit(-1);
+    }
+
+    /* Ready the context for the next call */
+    if (last) EVP_EncryptInit_ex(ctx, NULL, NULL, NULL, NULL);
+  }
+
+  OpensslEde3(const OpensslEde3 &);
+  OpensslEde3 &operator=(const OpensslEde3 &);
+};
+
+/* Time fn and record it against openssl_rate, the bytes per second of *
+ * OpenSSL at the same block and worker count.                         */
+template <class F>
+static bench_result measure(const char *name, uint64_t num_bytes,
+                            unsigned workers, int matches,
+                            double openssl_rate, F fn,
+                            const bench_options *options) {
+  uint64_t iterations;
+  bench_sample sample = bench_measure(fn, options, &iterations);
+
+  bench_result result = {"openssl",
+                         name,
+                         num_bytes,
+                         0,
+                         workers,
+                         iterations * num_bytes,
+                         sample.seconds,
+                         sample.cycles,
+                         0,
+                         matches,
+                         0};
+  if (openssl_rate > 0) {
+    result.relative = (result.bytes / result.seconds) / openssl_rate;
+  }
+  return result;
+}
+
+bool run_openssl(const bench_options *options,
+                 std::vector<bench_result> *results) {
+  uint8_t key[24];
+  if (!PKCS5_PBKDF2_HMAC(BENCH_PASSWORD, strlen(BENCH_PASSWORD), NULL, 0,
+                         100000, EVP_sha512(), 24, key)) {
+    fprintf(stderr, "Error while deriving key from password.\n");
+    exit(-1);
+  }
+
+  key_schedule K1, K2, K3;
+  Session::expand_key(key, &K1, &K2, &K3);
+
+  static engine_keys keys;
+  engine_load_keys(&K1, &K2, &K3, NULL, &keys);
+
+  bool all_match = true;
+
+  size_t b, w;
+  for (b = 0; b < options->block_counts.size(); b++) {
+    uint64_t num_blocks = options->block_counts[b];
+    uint64_t num_bytes = num_blocks * BLOCK_SIZE;
+
+    /* Plaintext, OpenSSL's padded ciphertext of it, and ours */
+    std::vector<uint8_t> plain(num_bytes), expected(num_bytes + BLOCK_SIZE),
+        actual(num_bytes + BLOCK_SIZE + NONCE_SIZE);
+    uint64_t i;
+    for (i = 0; i < num_bytes; i++) plain[i] = (i * 131) ^ (i >> 11);
+
+    OpensslEde3 oracle(key, 1, true);
+    oracle.encrypt(expected.data(), plain.data(), num_blocks);
+
+    /* OpenSSL and a session at every worker count */
+    double openssl_rate = 0;
+    for (w = 0; w < options->worker_counts.size(); w++) {
+      unsigned workers = options->worker_counts[w];
+
+      OpensslEde3 openssl(key, workers, false);
+      bench_result openssl_result = measure(
+          "openssl_des_ede3_ecb", num_bytes, workers, -1, 0,
+          [&](uint64_t n) {
+            uint64_t k;
+            for (k = 0; k < n; k++) {
+              openssl.encrypt(actual.data(), plain.data(), num_blocks);
+            }
+          },
+          options);
+      openssl_result.relative = 1;
+      results->push_back(openssl_result);
+
+      double rate = openssl_result.bytes / openssl_result.seconds;
+      if (w == 0 || workers == 1) openssl_rate = rate;
+
+      /* A session: encrypt must give OpenSSL's padded output, and      *
+       * decrypting OpenSSL's output must give back the plaintext.      */
+      tdes_options session_options = {};
+      session_options.block_mode = BLOCK_MODE_ECB;
+      session_options.num_workers = workers;
+      session_options.engine = options->engine;
+
+      ThreadPool pool(workers);
+      Session session(&session_options, &pool);
+      session.set_keys(&K1, &K2, &K3);
+
+      uint64_t out_length;
+      bool matches =
+          session.crypt_buffer(0, plain.data(), num_bytes, actual.data(),
+                               &out_length) &&
+          out_length == expected.size() &&
+          memcmp(actual.data(), expected.data(), out_length) == 0 &&
+          session.crypt_buffer(1, expected.data(), expected.size(),
+                               actual.data(), &out_length) &&
+          out_length == num_bytes &&
+          memcmp(actual.data(), plain.data(), num_bytes) == 0;
+      all_match = all_match && matches;
+
+      results->push_back(measure(
+          "session_ecb", num_bytes, workers, matches, rate,
+          [&](uint64_t n) {
+            uint64_t k, length;
+            for (k = 0; k < n; k++) {
+              session.crypt_buffer(0, plain.data(), num_bytes, actual.data(),
+                                   &length);
+            }
+          },
+          options));
+    }
+
+    /* Every engine the host supports on its own, against single-       *
+     * threaded OpenSSL, checked in both directions                     */
+    size_t num_engines, e;
+    const tdes_engine *engines = engine_list(&num_engines);
+    for (e = 0; e < num_engines; e++) {
+      const tdes_engine *engine = &engines[e];
+      if (!engine->supported()) continue;
+      if (num_blocks > MAX_REFERENCE_BLOCKS &&
+          strcmp(engine->name, "reference") == 0) {
+        continue;
+      }
+
+      engine->crypt(actual.data(), plain.data(), num_blocks, &keys, false);
+      bool matches = memcmp(actual.data(), expected.data(), num_bytes) == 0;
+      engine->crypt(actual.data(), expected.data(), num_blocks, &keys, true);
+      matches = matches && memcmp(actual.data(), plain.data(), num_bytes) == 0;
+      all_match = all_match && matches;
+
+      results->push_back(measure(
+          engine->name, num_bytes, 1, matches, openssl_rate,
+          [&](uint64_t n) {
+            uint64_t k;
+            for (k = 0; k < n; k++) {
+              engine->crypt(actual.data(), plain.data(), num_blocks, &keys,
+                            false);
+            }
+          },
+          options));
+    }
+  }
+
+  OPENSSL_cleanse(key, sizeof(key));
+
+  return all_match;
+}
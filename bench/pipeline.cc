@@ -0,0 +1,169 @@
+/*
+ *  Copyright (C) 2019 Zachary Mohling
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <string>
+#include <vector>
+
+#include "../lib/ThreadPool.h"
+#include "bench.h"
+#include "modes.h"
+#include "session.h"
+
+/* Bytes of generated data written at a time */
+#define FILL_SIZE (1024 * 1024)
+
+static const char *BLOCK_MODE_NAMES[] = {"ecb", "ctr", "cbc"};
+
+/* Create a file of length bytes of pseudorandom data under dir and    *
+ * return its path.                                                    */
+static std::string make_input(const std::string &dir, uint64_t length) {
+  std::string path = dir + "/tdes-bench-in-XXXXXX";
+  std::vector<char> name(path.begin(), path.end());
+  name.push_back('\0');
+
+  int fd = mkstemp(name.data());
+  if (fd < 0) {
+    fprintf(stderr, "Could not create file in %s. ERROR: %d\n", dir.c_str(),
+            errno);
+    exit(-1);
+  }
+
+  std::vector<uint8_t> fill(FILL_SIZE);
+  uint64_t state = 0x9E3779B97F4A7C15ULL ^ length;
+
+  uint64_t done = 0;
+  while (done < length) {
+    size_t i;
+    for (i = 0; i < fill.size(); i++) {
+      state ^= state << 13, state ^= state >> 7, state ^= state << 17;
+      fill[i] = state;
+    }
+
+    size_t num_bytes = std::min((uint64_t)fill.size(), length - done);
+    if (write(fd, fill.data(), num_bytes) != (ssize_t)num_bytes) {
+      fprintf(stderr, "Could not write %s. ERROR: %d\n", name.data(), errno);
+      exit(-7);
+    }
+    done += num_bytes;
+  }
+  close(fd);
+
+  return std::string(name.data());
+}
+
+/* Encrypt in_path into out_path through session, as run() does */
+static void crypt_path(Session *session, const std::string &in_path,
+                       const std::string &out_path) {
+  FILE *in_file = fopen(in_path.c_str(), "rb");
+  FILE *out_file = fopen(out_path.c_str(), "w+b");
+  if (!in_file || !out_file) {
+    fprintf(stderr, "Could not open file %s. ERROR: %d\n", in_path.c_str(),
+            errno);
+    exit(-1);
+  }
+
+  session->crypt_file(0, in_file, false, out_file, false, in_path);
+
+  fclose(in_file);
+  fclose(out_file);
+}
+
+void run_pipeline(const bench_options *options,
+                  std::vector<bench_result> *results) {
+  const char *tmp_dir = getenv("TMPDIR");
+  std::string dir = (tmp_dir && *tmp_dir) ? tmp_dir : "/tmp";
+  std::string out_path = dir + "/tdes-bench-out-" + std::to_string(getpid());
+
+  uint8_t key[24];
+  memset(key, 0x3C, sizeof(key));
+  key_schedule K1, K2, K3;
+  Session::expand_key(key, &K1, &K2, &K3);
+
+  const tdes_engine *engine =
+      options->engine ? options->engine : engine_default();
+  std::string name = std::string("encrypt_") +
+                     BLOCK_MODE_NAMES[options->block_mode] +
+                     (options->map_files ? "_mmap_" : "_") + engine->name;
+
+  size_t s, c, w;
+  for (s = 0; s < options->file_sizes.size(); s++) {
+    uint64_t file_size = options->file_sizes[s];
+    std::string in_path = make_input(dir, file_size);
+
+    for (c = 0; c < options->chunk_sizes.size(); c++) {
+      size_t first = results->size();
+
+      for (w = 0; w < options->worker_counts.size(); w++) {
+        tdes_options session_options = {};
+        session_options.block_mode = options->block_mode;
+        session_options.map_files = options->map_files;
+        session_options.chunk_size = options->chunk_sizes[c];
+        session_options.num_workers = options->worker_counts[w];
+        session_options.engine = options->engine;
+
+        ThreadPool pool(session_options.num_workers);
+        Session session(&session_options, &pool);
+        session.set_keys(&K1, &K2, &K3);
+
+        /* Warm the page cache and the session's buffers */
+        crypt_path(&session, in_path, out_path);
+
+        uint64_t iterations;
+        bench_sample sample = bench_measure(
+            [&](uint64_t n) {
+              uint64_t i;
+              for (i = 0; i < n; i++) crypt_path(&session, in_path, out_path);
+            },
+            options, &iterations);
+
+        bench_result result = {"pipeline",
+                               name,
+                               file_size,
+                               session.chunk_size(),
+                               session_options.num_workers,
+                               iterations * file_size,
+                               sample.seconds,
+                               sample.cycles,
+                               1,
+                               -1,
+                               0};
+        results->push_back(result);
+      }
+
+      /* Speedup over the fewest workers at this geometry */
+      size_t base = first, i;
+      for (i = first; i < results->size(); i++) {
+        if ((*results)[i].workers < (*results)[base].workers) base = i;
+      }
+      double base_rate = (*results)[base].bytes / (*results)[base].seconds;
+      for (i = first; i < results->size(); i++) {
+        (*results)[i].speedup =
+            ((*results)[i].bytes / (*results)[i].seconds) / base_rate;
+      }
+    }
+
+    unlink(in_path.c_str());
+  }
+
+  unlink(out_path.c_str());
+}
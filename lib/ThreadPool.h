@@ -1,55 +1,342 @@
 #ifndef THREAD_POOL_H
 #define THREAD_POOL_H
 
+#include <algorithm>
+#include <atomic>
+#include <chrono>
 #include <condition_variable>
+#include <cstddef>
+#include <cstdint>
 #include <functional>
 #include <future>
 #include <memory>
 #include <mutex>
-#include <queue>
+#include <new>
 #include <stdexcept>
 #include <thread>
+#include <type_traits>
+#include <utility>
 #include <vector>
 
+// Type-erased callable stored inline, so queueing a task never allocates.
+// Callables larger than storage_size are rejected at compile time.
+class PoolTask {
+ public:
+  static const size_t storage_size = 64;
+
+  PoolTask() : vtable(nullptr) {}
+  ~PoolTask() { reset(); }
+
+  template <class F>
+  void emplace(F&& f) {
+    typedef typename std::decay<F>::type callable;
+    static_assert(sizeof(callable) <= storage_size,
+                  "task too large for PoolTask storage");
+    static_assert(alignof(callable) <= alignof(std::max_align_t),
+                  "task over-aligned for PoolTask storage");
+
+    reset();
+    new (storage) callable(std::forward<F>(f));
+    vtable = &table_for<callable>::value;
+  }
+
+  // move the stored callable into other, leaving this task empty
+  void move_to(PoolTask& other) {
+    other.reset();
+    vtable->relocate(other.storage, storage);
+    other.vtable = vtable;
+    vtable = nullptr;
+  }
+
+  void run() {
+    vtable->invoke(storage);
+    reset();
+  }
+
+ private:
+  struct operations {
+    void (*invoke)(void*);
+    void (*relocate)(void*, void*);
+    void (*destroy)(void*);
+  };
+
+  template <class callable>
+  struct table_for {
+    static void invoke(void* p) { (*static_cast<callable*>(p))(); }
+    static void relocate(void* dst, void* src) {
+      new (dst) callable(std::move(*static_cast<callable*>(src)));
+      static_cast<callable*>(src)->~callable();
+    }
+    static void destroy(void* p) { static_cast<callable*>(p)->~callable(); }
+    static const operations value;
+  };
+
+  void reset() {
+    if (vtable) vtable->destroy(storage);
+    vtable = nullptr;
+  }
+
+  const operations* vtable;
+  alignas(std::max_align_t) unsigned char storage[storage_size];
+
+  PoolTask(const PoolTask&);
+  PoolTask& operator=(const PoolTask&);
+};
+
+template <class callable>
+const PoolTask::operations PoolTask::table_for<callable>::value = {
+    &PoolTask::table_for<callable>::invoke,
+    &PoolTask::table_for<callable>::relocate,
+    &PoolTask::table_for<callable>::destroy};
+
+// Work-stealing pool. Every worker owns a fixed-capacity deque: it pops the
+// tasks it spawned itself from the back, newest first, takes everything
+// else from the front in submission order, and steals from the front of
+// the others when it runs dry. Task storage is allocated once, in the
+// constructor; when every deque is full the submitting thread runs the task
+// itself.
 class ThreadPool {
  public:
-  ThreadPool(size_t);
+  // on_start, if given, runs first on each worker with the worker's index
+  ThreadPool(size_t threads, size_t queue_capacity = 256,
+             std::function<void(size_t)> on_start = nullptr);
   template <class F, class... Args>
   auto enqueue(F&& f, Args&&... args)
       -> std::future<typename std::result_of<F(Args...)>::type>;
+  // fire-and-forget: no future, no allocation
+  template <class F, class... Args>
+  void submit(F&& f, Args&&... args);
+  // queue count tasks at once; task i calls f(i)
+  template <class F>
+  void submit_bulk(size_t count, F f);
+  size_t size() const { return workers.size(); }
+  // block until ready() holds; whoever makes it true calls notify_waiters.
+  // The pool outlives its tasks, so a task may notify as its last act even
+  // when the waiter then tears down everything the task touched.
+  template <class F>
+  void wait_until(F ready);
+  // wake the threads in wait_until to check their conditions again; costs a
+  // fence when nobody waits
+  void notify_waiters();
+  // nanoseconds threads have spent blocked on the deques' locks
+  uint64_t lock_wait_ns() const { return lock_wait.load(); }
   ~ThreadPool();
 
  private:
+  struct work_queue {
+    std::mutex mutex;
+    std::unique_ptr<PoolTask[]> slots;
+    // whether each slot's task was pushed by the deque's own worker
+    std::unique_ptr<bool[]> spawned;
+    size_t head;  // next task to steal
+    size_t tail;  // one past the newest task
+  };
+
+  template <class F>
+  struct bulk_item {
+    F f;
+    size_t index;
+    void operator()() { f(index); }
+  };
+
+  void worker_loop(size_t self, std::function<void(size_t)> on_start);
+  std::unique_lock<std::mutex> lock_queue(work_queue& q);
+  bool try_pop(size_t self, PoolTask& task);
+  bool try_steal(size_t self, PoolTask& task);
+  template <class F>
+  void push(F&& f);
+  void wake(size_t count);
+  size_t current_worker() const;
+
   // need to keep track of threads so we can join them
   std::vector<std::thread> workers;
-  // the task queue
-  std::queue<std::function<void()> > tasks;
+  // one deque per worker, each a ring of capacity slots
+  std::unique_ptr<work_queue[]> queues;
+  size_t capacity;
+  std::atomic<size_t> next_queue;
+  std::atomic<uint64_t> lock_wait;
+
+  // tasks queued but not yet taken by a worker
+  std::atomic<size_t> pending;
+  std::atomic<size_t> idle;
 
-  // synchronization
-  std::mutex queue_mutex;
+  // synchronization for sleeping workers
+  std::mutex sleep_mutex;
   std::condition_variable condition;
-  bool stop;
+  std::atomic<bool> stop;
+
+  // synchronization for threads in wait_until
+  std::mutex wait_mutex;
+  std::condition_variable waiting;
+  std::atomic<size_t> num_waiting;
 };
 
-// the constructor just launches some amount of workers
-inline ThreadPool::ThreadPool(size_t threads) : stop(false) {
+// the constructor sizes the deques and launches some amount of workers
+inline ThreadPool::ThreadPool(size_t threads, size_t queue_capacity,
+                              std::function<void(size_t)> on_start)
+    : queues(new work_queue[threads > 0 ? threads : 1]),
+      capacity(queue_capacity > 0 ? queue_capacity : 1),
+      next_queue(0),
+      lock_wait(0),
+      pending(0),
+      idle(0),
+      stop(false),
+      num_waiting(0) {
+  if (threads == 0) threads = 1;
+
+  for (size_t i = 0; i < threads; ++i) {
+    queues[i].slots.reset(new PoolTask[capacity]);
+    queues[i].spawned.reset(new bool[capacity]());
+    queues[i].head = 0;
+    queues[i].tail = 0;
+  }
+
   for (size_t i = 0; i < threads; ++i)
-    workers.emplace_back([this] {
-      for (;;) {
-        std::function<void()> task;
-
-        {
-          std::unique_lock<std::mutex> lock(this->queue_mutex);
-          this->condition.wait(
-              lock, [this] { return this->stop || !this->tasks.empty(); });
-          if (this->stop && this->tasks.empty()) return;
-          task = std::move(this->tasks.front());
-          this->tasks.pop();
-        }
-
-        task();
-      }
+    workers.emplace_back(
+        [this, i, on_start] { this->worker_loop(i, on_start); });
+}
+
+// the pool and worker index of the worker running on this thread, if any
+struct pool_worker_slot {
+  const void* pool;
+  size_t index;
+};
+
+inline pool_worker_slot& this_pool_worker() {
+  static thread_local pool_worker_slot slot = {nullptr, SIZE_MAX};
+  return slot;
+}
+
+// index of this pool's worker running on this thread, or SIZE_MAX
+inline size_t ThreadPool::current_worker() const {
+  const pool_worker_slot& slot = this_pool_worker();
+  return slot.pool == this ? slot.index : SIZE_MAX;
+}
+
+inline void ThreadPool::worker_loop(size_t self,
+                                    std::function<void(size_t)> on_start) {
+  this_pool_worker().pool = this;
+  this_pool_worker().index = self;
+  if (on_start) on_start(self);
+
+  PoolTask task;
+  for (;;) {
+    if (try_pop(self, task) || try_steal(self, task)) {
+      task.run();
+      continue;
+    }
+
+    std::unique_lock<std::mutex> lock(sleep_mutex);
+    idle.fetch_add(1);
+    condition.wait(lock, [this] {
+      return this->stop.load() || this->pending.load() > 0;
     });
+    idle.fetch_sub(1);
+    if (stop.load() && pending.load() == 0) return;
+  }
+}
+
+// lock a deque, timing the wait only when another thread holds it
+inline std::unique_lock<std::mutex> ThreadPool::lock_queue(work_queue& q) {
+  std::unique_lock<std::mutex> lock(q.mutex, std::try_to_lock);
+  if (lock.owns_lock()) return lock;
+
+  auto start = std::chrono::steady_clock::now();
+  lock.lock();
+  lock_wait.fetch_add(std::chrono::duration_cast<std::chrono::nanoseconds>(
+                          std::chrono::steady_clock::now() - start)
+                          .count(),
+                      std::memory_order_relaxed);
+  return lock;
+}
+
+// the newest task if this worker spawned it, keeping its data in cache, else
+// the oldest, so work from outside the pool finishes in the order it came
+inline bool ThreadPool::try_pop(size_t self, PoolTask& task) {
+  work_queue& q = queues[self];
+  std::unique_lock<std::mutex> lock = lock_queue(q);
+  if (q.head == q.tail) return false;
+
+  if (q.spawned[(q.tail - 1) % capacity]) {
+    --q.tail;
+    q.slots[q.tail % capacity].move_to(task);
+  } else {
+    q.slots[q.head % capacity].move_to(task);
+    ++q.head;
+  }
+  pending.fetch_sub(1);
+  return true;
+}
+
+inline bool ThreadPool::try_steal(size_t self, PoolTask& task) {
+  for (size_t i = 1; i < workers.size(); ++i) {
+    work_queue& q = queues[(self + i) % workers.size()];
+    std::unique_lock<std::mutex> lock = lock_queue(q);
+    if (q.head == q.tail) continue;
+
+    q.slots[q.head % capacity].move_to(task);
+    ++q.head;
+    pending.fetch_sub(1);
+    return true;
+  }
+  return false;
+}
+
+// place f in the submitting worker's own deque, or round-robin from outside
+// the pool; run it here if every deque is full
+template <class F>
+void ThreadPool::push(F&& f) {
+  // don't allow submitting after stopping the pool
+  if (stop.load()) throw std::runtime_error("enqueue on stopped ThreadPool");
+
+  size_t self = current_worker();
+  size_t first = self < workers.size() ? self : next_queue.fetch_add(1);
+
+  pending.fetch_add(1);
+  for (size_t i = 0; i < workers.size(); ++i) {
+    work_queue& q = queues[(first + i) % workers.size()];
+    std::unique_lock<std::mutex> lock = lock_queue(q);
+    if (q.tail - q.head == capacity) continue;
+
+    q.slots[q.tail % capacity].emplace(std::forward<F>(f));
+    q.spawned[q.tail % capacity] = (i == 0 && self < workers.size());
+    ++q.tail;
+    return;
+  }
+  pending.fetch_sub(1);
+
+  f();
+}
+
+inline void ThreadPool::wake(size_t count) {
+  if (idle.load() == 0) return;
+
+  { std::lock_guard<std::mutex> lock(sleep_mutex); }
+  if (count == 1)
+    condition.notify_one();
+  else
+    condition.notify_all();
+}
+
+// the fences pair up so that either the notifier sees the waiter counted or
+// the waiter sees the condition the notifier made true
+template <class F>
+void ThreadPool::wait_until(F ready) {
+  if (ready()) return;
+
+  std::unique_lock<std::mutex> lock(wait_mutex);
+  num_waiting.fetch_add(1, std::memory_order_relaxed);
+  std::atomic_thread_fence(std::memory_order_seq_cst);
+  while (!ready()) waiting.wait(lock);
+  num_waiting.fetch_sub(1, std::memory_order_relaxed);
+}
+
+inline void ThreadPool::notify_waiters() {
+  std::atomic_thread_fence(std::memory_order_seq_cst);
+  if (num_waiting.load(std::memory_order_relaxed) == 0) return;
+
+  { std::lock_guard<std::mutex> lock(wait_mutex); }
+  waiting.notify_all();
 }
 
 // add new work item to the pool
@@ -62,23 +349,55 @@ auto ThreadPool::enqueue(F&& f, Args&&... args)
       std::bind(std::forward<F>(f), std::forward<Args>(args)...));
 
   std::future<return_type> res = task->get_future();
-  {
-    std::unique_lock<std::mutex> lock(queue_mutex);
+  push([task]() { (*task)(); });
+  wake(1);
+  return res;
+}
+
+template <class F, class... Args>
+void ThreadPool::submit(F&& f, Args&&... args) {
+  push(std::bind(std::forward<F>(f), std::forward<Args>(args)...));
+  wake(1);
+}
 
-    // don't allow enqueueing after stopping the pool
-    if (stop) throw std::runtime_error("enqueue on stopped ThreadPool");
+// spread the tasks over the deques in contiguous runs, taking each deque's
+// lock once, then wake the workers together. Bulk tasks are taken in order
+// even when a worker submits them.
+template <class F>
+void ThreadPool::submit_bulk(size_t count, F f) {
+  if (stop.load()) throw std::runtime_error("enqueue on stopped ThreadPool");
+  if (count == 0) return;
 
-    tasks.emplace([task]() { (*task)(); });
+  size_t num_queues = workers.size();
+  size_t first = next_queue.fetch_add(1);
+  size_t per_queue = (count + num_queues - 1) / num_queues;
+  size_t next = 0;
+
+  pending.fetch_add(count);
+  for (size_t i = 0; i < num_queues && next < count; ++i) {
+    work_queue& q = queues[(first + i) % num_queues];
+    std::unique_lock<std::mutex> lock = lock_queue(q);
+
+    size_t room = capacity - (q.tail - q.head);
+    size_t run = std::min(std::min(per_queue, room), count - next);
+    for (size_t j = 0; j < run; ++j, ++next, ++q.tail) {
+      bulk_item<F> item = {f, next};
+      q.slots[q.tail % capacity].emplace(std::move(item));
+      q.spawned[q.tail % capacity] = false;
+    }
   }
-  condition.notify_one();
-  return res;
+  if (next > 0) wake(next);
+
+  // whatever did not fit runs on the caller
+  if (next < count) pending.fetch_sub(count - next);
+  for (; next < count; ++next) f(next);
 }
 
-// the destructor joins all threads
+// the destructor lets the workers drain their deques, then joins them
 inline ThreadPool::~ThreadPool() {
   {
-    std::unique_lock<std::mutex> lock(queue_mutex);
-    stop = true;
+    std::unique_lock<std::mutex> lock(sleep_mutex);
+    stop.store(true);
   }
   condition.notify_all();
   for (std::thread& worker : workers) worker.join();
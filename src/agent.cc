@@ -0,0 +1,266 @@
+/*
+ *  Copyright (C) 2019 Zachary Mohling
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "agent.h"
+
+#include <openssl/crypto.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/types.h>
+#include <sys/un.h>
+
+#include <errno.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <string>
+
+#ifndef MSG_NOSIGNAL
+#define MSG_NOSIGNAL 0
+#endif
+
+/* Set by SIGINT and SIGTERM to stop serving */
+static volatile sig_atomic_t stopping = 0;
+
+static void stop_serving(int signal_number) {
+  (void)signal_number;
+  stopping = 1;
+}
+
+std::string agent_socket_path() {
+  const char *runtime_dir = getenv("XDG_RUNTIME_DIR");
+  if (runtime_dir && *runtime_dir) {
+    return std::string(runtime_dir) + "/tdes-agent.sock";
+  }
+
+  char path[64];
+  snprintf(path, sizeof(path), "/tmp/tdes-agent-%u.sock", (unsigned)getuid());
+  return path;
+}
+
+/* Whether the process at the other end of fd runs as this user */
+static bool peer_is_self(int fd) {
+  uid_t uid;
+#if defined(__linux__)
+  struct ucred credentials;
+  socklen_t length = sizeof(credentials);
+  if (getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &credentials, &length) != 0) {
+    return false;
+  }
+  uid = credentials.uid;
+#else
+  gid_t gid;
+  if (getpeereid(fd, &uid, &gid) != 0) return false;
+#endif
+
+  return uid == getuid();
+}
+
+static bool socket_address(const char *path, struct sockaddr_un *address) {
+  memset(address, 0, sizeof(*address));
+  address->sun_family = AF_UNIX;
+
+  if (strlen(path) >= sizeof(address->sun_path)) {
+    errno = ENAMETOOLONG;
+    return false;
+  }
+  strcpy(address->sun_path, path);
+  return true;
+}
+
+static bool send_all(int fd, const void *data, size_t num_bytes) {
+  const uint8_t *bytes = (const uint8_t *)data;
+  size_t done = 0;
+  while (done < num_bytes) {
+    ssize_t n = send(fd, bytes + done, num_bytes - done, MSG_NOSIGNAL);
+    if (n < 0 && errno == EINTR) continue;
+    if (n <= 0) return false;
+    done += n;
+  }
+  return true;
+}
+
+static bool receive_all(int fd, void *data, size_t num_bytes) {
+  uint8_t *bytes = (uint8_t *)data;
+  size_t done = 0;
+  while (done < num_bytes) {
+    ssize_t n = recv(fd, bytes + done, num_bytes - done, 0);
+    if (n < 0 && errno == EINTR) continue;
+    if (n <= 0) return false;
+    done += n;
+  }
+  return true;
+}
+
+/* Connect to the agent at path and send request. Returns the socket, or *
+ * -1 if the agent cannot be reached or runs as another user.            */
+static int agent_request(const char *path, const char *request) {
+  struct sockaddr_un address;
+  if (!socket_address(path, &address)) return -1;
+
+  int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (fd < 0) return -1;
+
+  if (connect(fd, (struct sockaddr *)&address, sizeof(address)) != 0 ||
+      !peer_is_self(fd) || !send_all(fd, request, AGENT_REQUEST_SIZE)) {
+    close(fd);
+    return -1;
+  }
+
+  return fd;
+}
+
+bool agent_fetch_keys(key_schedule *K1, key_schedule *K2, key_schedule *K3) {
+  const char *path = getenv(AGENT_SOCKET_ENV);
+  if (!path || !*path) return false;
+
+  int fd = agent_request(path, AGENT_REQUEST_KEYS);
+  if (fd < 0) {
+    fprintf(stderr, "Could not reach tdes-agent at %s. ERROR: %d\n", path,
+            errno);
+    return false;
+  }
+
+  agent_reply reply;
+  bool received = receive_all(fd, &reply, sizeof(reply));
+  close(fd);
+
+  if (!received || memcmp(reply.magic, AGENT_REPLY_MAGIC, 4) != 0 ||
+      reply.schedule_size != sizeof(key_schedule)) {
+    fprintf(stderr, "Invalid reply from tdes-agent at %s.\n", path);
+    OPENSSL_cleanse(&reply, sizeof(reply));
+    return false;
+  }
+
+  *K1 = reply.keys[0];
+  *K2 = reply.keys[1];
+  *K3 = reply.keys[2];
+
+  OPENSSL_cleanse(&reply, sizeof(reply));
+  return true;
+}
+
+bool agent_stop(const char *path) {
+  int fd = agent_request(path, AGENT_REQUEST_STOP);
+  if (fd < 0) return false;
+
+  close(fd);
+  return true;
+}
+
+int agent_listen(const char *path) {
+  struct sockaddr_un address;
+  if (!socket_address(path, &address)) {
+    fprintf(stderr, "Socket path too long: %s\n", path);
+    exit(-1);
+  }
+
+  /* A socket left behind by an agent that is gone may be replaced, but *
+   * never one of another user or a live agent.                         */
+  struct stat path_stat;
+  if (lstat(path, &path_stat) == 0) {
+    if (!S_ISSOCK(path_stat.st_mode) || path_stat.st_uid != getuid()) {
+      fprintf(stderr, "Aborting. %s exists and is not our socket.\n", path);
+      exit(-1);
+    }
+
+    int fd = agent_request(path, "PING");
+    if (fd >= 0) {
+      close(fd);
+      fprintf(stderr, "Aborting. An agent is already listening on %s.\n",
+              path);
+      exit(-1);
+    }
+    unlink(path);
+  }
+
+  int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (fd < 0) {
+    fprintf(stderr, "Could not create socket. ERROR: %d\n", errno);
+    exit(-1);
+  }
+
+  mode_t old_mask = umask(0077);
+  int bound = bind(fd, (struct sockaddr *)&address, sizeof(address));
+  umask(old_mask);
+
+  if (bound != 0 || listen(fd, 16) != 0) {
+    fprintf(stderr, "Could not listen on %s. ERROR: %d\n", path, errno);
+    exit(-1);
+  }
+
+  return fd;
+}
+
+/* Answer one connection. Returns false if it asked the agent to stop. */
+static bool answer(int fd, const agent_reply *reply) {
+  if (!peer_is_self(fd)) return true;
+
+  /* A client that connects and says nothing must not stall the agent */
+  struct timeval timeout = {1, 0};
+  setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+  setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+
+  char request[AGENT_REQUEST_SIZE];
+  if (!receive_all(fd, request, sizeof(request))) return true;
+
+  if (memcmp(request, AGENT_REQUEST_KEYS, AGENT_REQUEST_SIZE) == 0) {
+    send_all(fd, reply, sizeof(*reply));
+  } else if (memcmp(request, AGENT_REQUEST_STOP, AGENT_REQUEST_SIZE) == 0) {
+    return false;
+  }
+
+  return true;
+}
+
+void agent_serve(int listen_fd, const char *path, agent_reply *reply,
+                 unsigned idle_timeout) {
+  struct sigaction action;
+  memset(&action, 0, sizeof(action));
+  action.sa_handler = stop_serving;
+  sigaction(SIGINT, &action, NULL);
+  sigaction(SIGTERM, &action, NULL);
+  sigaction(SIGHUP, &action, NULL);
+  signal(SIGPIPE, SIG_IGN);
+
+  struct pollfd listener = {listen_fd, POLLIN, 0};
+  int timeout = idle_timeout ? (int)idle_timeout * 1000 : -1;
+
+  while (!stopping) {
+    int ready = poll(&listener, 1, timeout);
+    if (ready < 0 && errno == EINTR) continue;
+    if (ready <= 0) break;
+
+    int fd = accept(listen_fd, NULL, NULL);
+    if (fd < 0) continue;
+
+    bool keep_serving = answer(fd, reply);
+    close(fd);
+
+    if (!keep_serving) break;
+  }
+
+  OPENSSL_cleanse(reply, sizeof(*reply));
+
+  close(listen_fd);
+  unlink(path);
+}
@@ -0,0 +1,74 @@
+/*
+ *  Copyright (C) 2019 Zachary Mohling
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef AGENT_H_
+#define AGENT_H_
+
+#include <string>
+
+#include "cipher.h"
+
+/* Environment variable naming the agent's socket. tdes asks the agent  *
+ * for its keys only when it is set, as printed by tdes-agent on start. */
+#define AGENT_SOCKET_ENV "TDES_AGENT_SOCK"
+
+/* Seconds without a request after which the agent wipes its keys and *
+ * exits, unless told otherwise, and the longest timeout allowed.     */
+#define AGENT_IDLE_TIMEOUT (15 * 60)
+#define AGENT_MAX_IDLE_TIMEOUT (24 * 60 * 60)
+
+/* Requests, each a 4-byte code. KEYS is answered with an agent_reply;   *
+ * STOP makes the agent wipe its keys and exit.                          */
+#define AGENT_REQUEST_SIZE 4
+#define AGENT_REQUEST_KEYS "KEYS"
+#define AGENT_REQUEST_STOP "STOP"
+
+/* Reply to KEYS: a magic tag, the size of one schedule so that builds   *
+ * with another layout are refused, and the schedules of K1, K2 and K3.  */
+#define AGENT_REPLY_MAGIC "TDA1"
+
+typedef struct agent_reply {
+  char magic[4];
+  uint32_t schedule_size;
+  key_schedule keys[3];
+} agent_reply;
+
+/* Default socket: $XDG_RUNTIME_DIR/tdes-agent.sock, or a per-user path *
+ * under /tmp.                                                          */
+std::string agent_socket_path();
+
+/* Fetch the schedules of K1, K2 and K3 from the agent named by          *
+ * AGENT_SOCKET_ENV. Returns false, leaving them untouched, if the       *
+ * variable is unset or the agent cannot be reached or is not run by     *
+ * this user.                                                            */
+bool agent_fetch_keys(key_schedule *K1, key_schedule *K2, key_schedule *K3);
+
+/* Ask the agent at path to wipe its keys and exit. Returns false if it *
+ * cannot be reached.                                                   */
+bool agent_stop(const char *path);
+
+/* Bind and listen on path, readable by this user only. Exits on error. */
+int agent_listen(const char *path);
+
+/* Answer requests on listen_fd from processes of this user, out of     *
+ * reply, until idle_timeout seconds pass without one (never if 0), a   *
+ * STOP request arrives or the process is signalled. Then wipe reply    *
+ * and remove the socket at path.                                       */
+void agent_serve(int listen_fd, const char *path, agent_reply *reply,
+                 unsigned idle_timeout);
+
+#endif  // AGENT_H_
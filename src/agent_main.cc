@@ -0,0 +1,178 @@
+/*
+ *  Copyright (C) 2019 Zachary Mohling
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include <openssl/crypto.h>
+#include <sys/mman.h>
+#if defined(__linux__)
+#include <sys/prctl.h>
+#endif
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <iostream>
+#include <string>
+
+#include "agent.h"
+#include "key_generator.h"
+#include "tdes.h"
+
+#define USAGE                                                    \
+  "Incorrect usage: tdes-agent [options]\n"                      \
+  "  --socket PATH     where to listen, or the agent to stop\n"  \
+  "  --timeout SECONDS exit when idle this long, 0 for never\n"  \
+  "  -k|--kill         stop the running agent\n"
+
+/* Keep the schedules out of swap and core dumps, and the process out of *
+ * reach of debuggers run by the same user.                              */
+static void protect_keys(agent_reply *reply) {
+  if (mlock(reply, sizeof(*reply)) != 0) {
+    fprintf(stderr, "Could not lock key memory. ERROR: %d\n", errno);
+    exit(-1);
+  }
+#if defined(__linux__)
+  madvise(reply, sizeof(*reply), MADV_DONTDUMP);
+  prctl(PR_SET_DUMPABLE, 0);
+#endif
+}
+
+/* Quote value for a POSIX shell: wrap it in single quotes, closing and *
+ * reopening them around each embedded one.                            */
+static std::string shell_quote(const std::string &value) {
+  std::string quoted = "'";
+  for (char c : value) {
+    if (c == '\'') {
+      quoted += "'\\''";
+    } else {
+      quoted += c;
+    }
+  }
+  return quoted + "'";
+}
+
+/* Derives the keys from a password once, then forks into the background *
+ * and hands their schedules to tdes over a UNIX domain socket until it   *
+ * is idle for too long. Prints the shell commands that point tdes at it. */
+int main(int argc, char *argv[]) {
+  std::string path;
+  unsigned idle_timeout = AGENT_IDLE_TIMEOUT;
+  bool kill_agent = false;
+
+  int i;
+  for (i = 1; i < argc; i++) {
+    std::string arg(argv[i]);
+    bool has_value = (i + 1 < argc);
+
+    if (arg == "--socket" && has_value) {
+      path = argv[++i];
+    } else if (arg == "--timeout" && has_value) {
+      char *end;
+      errno = 0;
+      unsigned long value = strtoul(argv[++i], &end, 10);
+      if (errno != 0 || *end != '\0' || end == argv[i] ||
+          value > AGENT_MAX_IDLE_TIMEOUT) {
+        fprintf(stderr, "Invalid value for --timeout: %s\n", argv[i]);
+        return -2;
+      }
+      idle_timeout = value;
+    } else if (arg == "-k" || arg == "--kill") {
+      kill_agent = true;
+    } else {
+      fprintf(stderr, USAGE);
+      return -2;
+    }
+  }
+
+  if (path.empty()) {
+    const char *env_path = getenv(AGENT_SOCKET_ENV);
+    path = (kill_agent && env_path && *env_path) ? env_path
+                                                 : agent_socket_path();
+  }
+
+  if (kill_agent) {
+    if (!agent_stop(path.c_str())) {
+      fprintf(stderr, "Could not reach tdes-agent at %s.\n", path.c_str());
+      return -1;
+    }
+    printf("unset %s;\n", AGENT_SOCKET_ENV);
+    return 0;
+  }
+
+  /* The schedules live in a page of their own that is never swapped */
+  void *page = mmap(NULL, sizeof(agent_reply), PROT_READ | PROT_WRITE,
+                    MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (page == MAP_FAILED) {
+    fprintf(stderr, "Insufficient memory. ERROR: %d\n", errno);
+    exit(-1);
+  }
+
+  agent_reply *reply = (agent_reply *)page;
+  protect_keys(reply);
+
+  memcpy(reply->magic, AGENT_REPLY_MAGIC, 4);
+  reply->schedule_size = sizeof(key_schedule);
+
+  /* Stdout is for the shell commands, usually captured by eval, so the *
+   * prompts go to stderr while the password is read.                  */
+  int stdout_fd = dup(STDOUT_FILENO);
+  dup2(STDERR_FILENO, STDOUT_FILENO);
+
+  init_keys(&reply->keys[0], &reply->keys[1], &reply->keys[2], 0);
+
+  std::cout.flush();
+  dup2(stdout_fd, STDOUT_FILENO);
+  close(stdout_fd);
+
+  int listen_fd = agent_listen(path.c_str());
+
+  pid_t pid = fork();
+  if (pid < 0) {
+    fprintf(stderr, "Could not start agent. ERROR: %d\n", errno);
+    exit(-1);
+  }
+
+  if (pid > 0) {
+    OPENSSL_cleanse(reply, sizeof(*reply));
+    printf("%s=%s; export %s;\n", AGENT_SOCKET_ENV,
+           shell_quote(path).c_str(), AGENT_SOCKET_ENV);
+    printf("echo Agent pid %d;\n", (int)pid);
+    return 0;
+  }
+
+  /* Locks are not inherited across fork */
+  protect_keys(reply);
+
+  setsid();
+
+  int null_fd = open("/dev/null", O_RDWR);
+  if (null_fd >= 0) {
+    dup2(null_fd, STDIN_FILENO);
+    dup2(null_fd, STDOUT_FILENO);
+    dup2(null_fd, STDERR_FILENO);
+    if (null_fd > STDERR_FILENO) close(null_fd);
+  }
+
+  agent_serve(listen_fd, path.c_str(), reply, idle_timeout);
+
+  munlock(reply, sizeof(*reply));
+  munmap(reply, sizeof(*reply));
+  return 0;
+}
@@ -0,0 +1,124 @@
+/*
+ *  Copyright (C) 2019 Zachary Mohling
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "bitslice.h"
+
+#include <stdint.h>
+#include <string.h>
+
+#include "bitslice_impl.h"
+#include "cipher.h"
+
+/* Portable kernel, one block per bit of a 64-bit word */
+static void crypt_u64(uint8_t *out, const uint8_t *in, size_t num_batches,
+                      const bitslice_keys *keys, bool decrypting) {
+  bitslice_crypt<uint64_t>(out, in, num_batches, keys, decrypting);
+}
+
+const bitslice_kernel bitslice_u64 = {"u64", 64, crypt_u64};
+
+/* Every kernel, indexed by BitsliceKernel */
+static const bitslice_kernel *const kernels[NUM_BITSLICE_KERNELS] = {
+    &bitslice_u64, &bitslice_sse2, &bitslice_avx2, &bitslice_avx512};
+
+static bool cpu_supports(int kernel) {
+  if (kernels[kernel]->width == 0) return false;
+
+#if defined(__x86_64__) || defined(__i386__)
+  __builtin_cpu_init();
+  if (kernel == BITSLICE_AVX512) return __builtin_cpu_supports("avx512f");
+  if (kernel == BITSLICE_AVX2) return __builtin_cpu_supports("avx2");
+  if (kernel == BITSLICE_SSE2) return __builtin_cpu_supports("sse2");
+#endif
+
+  return kernel == BITSLICE_U64;
+}
+
+/* masks[v][i] is all ones if bit i of v, counted from the most      *
+ * significant, is set. Widens a round key a byte at a time.           */
+typedef struct mask_table {
+  uint64_t masks[256][8];
+} mask_table;
+
+static constexpr mask_table make_mask_table() {
+  mask_table table = {};
+
+  for (unsigned value = 0; value < 256; value++) {
+    for (int bit = 0; bit < 8; bit++) {
+      table.masks[value][bit] = 0 - (uint64_t)((value >> (7 - bit)) & 0x01);
+    }
+  }
+
+  return table;
+}
+
+static constexpr mask_table byte_masks = make_mask_table();
+
+bool bitslice_supported(int kernel) {
+  return kernel >= 0 && kernel < NUM_BITSLICE_KERNELS && cpu_supports(kernel);
+}
+
+void bitslice_load_keys(const key_schedule *K1, const key_schedule *K2,
+                        const key_schedule *K3, bitslice_keys *keys) {
+  const key_schedule *schedules[] = {K1, K2, K3};
+
+  int key, round, byte;
+  for (key = 0; key < 3; key++) {
+    for (round = 0; round < NUM_ROUNDS; round++) {
+      const uint8_t *sub_key = schedules[key]->sub_keys[round];
+      uint64_t *masks = keys->masks[key][round];
+
+      for (byte = 0; byte < SUBKEY_SIZE; byte++) {
+        memcpy(masks + (byte * 8), byte_masks.masks[sub_key[byte]],
+               sizeof(byte_masks.masks[0]));
+      }
+    }
+  }
+}
+
+/* Run full batches through kernel, then step down through the narrower *
+ * ones, which every host of the wider ones also supports. A final       *
+ * partial batch goes through a scratch batch of the 64-block kernel.    */
+void bitslice_crypt_kernel(int kernel, uint8_t *out, const uint8_t *in,
+                           size_t num_blocks, const bitslice_keys *keys,
+                           bool decrypting) {
+  int i;
+  for (i = kernel; i >= BITSLICE_U64; i--) {
+    const bitslice_kernel *k = kernels[i];
+    if (k->width == 0) continue;
+
+    size_t num_batches = num_blocks / k->width;
+    if (num_batches == 0) continue;
+
+    k->crypt(out, in, num_batches, keys, decrypting);
+
+    out += num_batches * k->width * BLOCK_SIZE;
+    in += num_batches * k->width * BLOCK_SIZE;
+    num_blocks -= num_batches * k->width;
+  }
+
+  if (num_blocks > 0) {
+    uint8_t scratch[64 * BLOCK_SIZE];
+
+    memset(scratch, 0, sizeof(scratch));
+    memcpy(scratch, in, num_blocks * BLOCK_SIZE);
+
+    bitslice_u64.crypt(scratch, scratch, 1, keys, decrypting);
+
+    memcpy(out, scratch, num_blocks * BLOCK_SIZE);
+  }
+}
@@ -0,0 +1,64 @@
+/*
+ *  Copyright (C) 2019 Zachary Mohling
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef BITSLICE_H_
+#define BITSLICE_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "cipher.h"
+
+/* Bitsliced Triple DES. A batch of 64, 128, 256 or 512 blocks is         *
+ * transposed into 64 bit planes, one register per bit position, so that  *
+ * every instruction advances one bit of every block in the batch. The    *
+ * permutations become register renaming and the S-boxes are evaluated as *
+ * boolean gate networks, which also makes the engine constant-time.      */
+
+/* Round keys of K1, K2 and K3 with every subkey bit widened to a mask of *
+ * all zeros or all ones. Built once per key set by bitslice_load_keys.   */
+typedef struct bitslice_keys {
+  uint64_t masks[3][NUM_ROUNDS][EXPANSION_SIZE * 8];
+} bitslice_keys;
+
+void bitslice_load_keys(const key_schedule *K1, const key_schedule *K2,
+                        const key_schedule *K3, bitslice_keys *keys);
+
+/* Kernels, narrowest first. Each is built for its own instruction set *
+ * and runs only where the host supports it.                           */
+enum BitsliceKernel {
+  BITSLICE_U64,
+  BITSLICE_SSE2,
+  BITSLICE_AVX2,
+  BITSLICE_AVX512,
+  NUM_BITSLICE_KERNELS
+};
+
+/* Whether kernel was compiled in and the host's CPUID reports its      *
+ * instruction set.                                                     */
+bool bitslice_supported(int kernel);
+
+/* Triple DES (EDE) encrypt or decrypt num_blocks 8-byte blocks from in  *
+ * to out, which may be the same buffer, through kernel and the narrower *
+ * kernels below it, which must be supported. Any block count is         *
+ * accepted; a partial batch is run through a scratch batch of the       *
+ * narrowest kernel.                                                     */
+void bitslice_crypt_kernel(int kernel, uint8_t *out, const uint8_t *in,
+                           size_t num_blocks, const bitslice_keys *keys,
+                           bool decrypting);
+
+#endif  // BITSLICE_H_
@@ -0,0 +1,38 @@
+/*
+ *  Copyright (C) 2019 Zachary Mohling
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+/* 256-block bitslice kernel. Built with the AVX2 instruction set enabled; *
+ * selected at runtime only on hosts that support it.                    */
+
+#include "bitslice_impl.h"
+
+#if defined(__AVX2__)
+
+typedef uint64_t bitslice_avx2_t __attribute__((vector_size(32)));
+
+static void crypt_avx2(uint8_t *out, const uint8_t *in, size_t num_batches,
+                       const bitslice_keys *keys, bool decrypting) {
+  bitslice_crypt<bitslice_avx2_t>(out, in, num_batches, keys, decrypting);
+}
+
+const bitslice_kernel bitslice_avx2 = {"avx2", 256, crypt_avx2};
+
+#else
+
+const bitslice_kernel bitslice_avx2 = {"avx2", 0, NULL};
+
+#endif
@@ -0,0 +1,792 @@
+/*
+ *  Copyright (C) 2019 Zachary Mohling
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+/* Kernel shared by the bitslice translation units. Each unit includes   *
+ * this header once and instantiates bitslice_crypt with its own register *
+ * type, compiled for its own instruction set. Everything here has        *
+ * internal linkage so no instance can leak into another unit.            */
+
+#ifndef BITSLICE_IMPL_H_
+#define BITSLICE_IMPL_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "bitslice.h"
+#include "cipher.h"
+
+#define BITSLICE_PLANES 64
+
+/* Zero-based forms of IP and FP */
+typedef struct bitslice_tables {
+  uint8_t ip[64], fp[64];
+} bitslice_tables;
+
+static constexpr bitslice_tables make_bitslice_tables() {
+  bitslice_tables tables = {};
+
+  for (int i = 0; i < 64; i++) {
+    tables.ip[i] = IP[i] - 1;
+    tables.fp[i] = FP[i] - 1;
+  }
+
+  return tables;
+}
+
+/* Generated by the compiler, so every kernel unit indexes its planes *
+ * through constants and nothing is set up at startup.                */
+static constexpr bitslice_tables BITSLICE_TABLES = make_bitslice_tables();
+
+typedef void (*bitslice_crypt_fn)(uint8_t *out, const uint8_t *in,
+                                  size_t num_batches,
+                                  const bitslice_keys *keys, bool decrypting);
+
+/* A kernel compiled for one instruction set. width is the number of     *
+ * blocks per batch, or 0 if the unit was built without the instruction  *
+ * set enabled.                                                          */
+typedef struct bitslice_kernel {
+  const char *name;
+  unsigned width;
+  bitslice_crypt_fn crypt;
+} bitslice_kernel;
+
+extern const bitslice_kernel bitslice_u64, bitslice_sse2, bitslice_avx2,
+    bitslice_avx512;
+
+static inline uint64_t bitslice_load_be64(const uint8_t *bytes) {
+  uint64_t word = 0;
+  int byte;
+  for (byte = 0; byte < 8; byte++) word = (word << 8) | bytes[byte];
+  return word;
+}
+
+static inline void bitslice_store_be64(uint64_t word, uint8_t *bytes) {
+  int byte;
+  for (byte = 7; byte >= 0; byte--, word >>= 8) bytes[byte] = word;
+}
+
+/* Transpose a 64x64 bit matrix in place, rows being words and columns *
+ * being bits counted from the most significant one.                   */
+static inline void bitslice_transpose64(uint64_t rows[64]) {
+  uint64_t mask = 0x00000000FFFFFFFFULL, t;
+  int j, k;
+  for (j = 32; j != 0; j >>= 1, mask ^= mask << j) {
+    for (k = 0; k < 64; k = (k + j + 1) & ~j) {
+      t = (rows[k] ^ (rows[k + j] >> j)) & mask;
+      rows[k] ^= t;
+      rows[k + j] ^= t << j;
+    }
+  }
+}
+
+/* Spread a batch of blocks over 64 bit planes. Plane i holds bit i + 1 *
+ * of every block, one block per lane.                                  */
+template <class V>
+static inline void bitslice_load(const uint8_t *batch, V planes[64]) {
+  const size_t WORDS = sizeof(V) / sizeof(uint64_t);
+  uint64_t words[BITSLICE_PLANES][WORDS], rows[64];
+
+  size_t word;
+  int i;
+  for (word = 0; word < WORDS; word++) {
+    for (i = 0; i < 64; i++) {
+      rows[i] = bitslice_load_be64(batch + ((word * 64) + i) * BLOCK_SIZE);
+    }
+
+    bitslice_transpose64(rows);
+
+    for (i = 0; i < BITSLICE_PLANES; i++) words[i][word] = rows[i];
+  }
+
+  for (i = 0; i < BITSLICE_PLANES; i++) memcpy(&planes[i], words[i], sizeof(V));
+}
+
+template <class V>
+static inline void bitslice_store(const V planes[64], uint8_t *batch) {
+  const size_t WORDS = sizeof(V) / sizeof(uint64_t);
+  uint64_t words[BITSLICE_PLANES][WORDS], rows[64];
+
+  size_t word;
+  int i;
+  for (i = 0; i < BITSLICE_PLANES; i++) memcpy(words[i], &planes[i], sizeof(V));
+
+  for (word = 0; word < WORDS; word++) {
+    for (i = 0; i < BITSLICE_PLANES; i++) rows[i] = words[i][word];
+
+    bitslice_transpose64(rows);
+
+    for (i = 0; i < 64; i++) {
+      bitslice_store_be64(rows[i], batch + ((word * 64) + i) * BLOCK_SIZE);
+    }
+  }
+}
+
+/* The eight S-boxes as gate networks over their input bits b1..b6, in  *
+ * a1..a6. Each was found offline by a search over multiplexer          *
+ * decompositions that shares gates between the four outputs, as in     *
+ * Kwan's bitslice DES, and checked against the tables of des_tables.h. *
+ * The outputs are XORed into the planes P moves them to.               */
+
+/* S1, 63 gates */
+template <class V>
+static inline void bitslice_s1(V a1, V a2, V a3, V a4, V a5, V a6, V *out1,
+                               V *out2, V *out3, V *out4) {
+  V x1 = a5 ^ a6;
+  V x2 = a5 | a6;
+  V x3 = a4 & x2;
+  V x4 = x1 ^ x3;
+  V x5 = a1 ^ a4;
+  V x6 = a5 & a1;
+  V x7 = x5 | x6;
+  V x8 = x7 & ~a2;
+  V x9 = x4 ^ x8;
+  V x10 = a1 ^ x3;
+  V x11 = ~x5;
+  V x12 = x11 & ~a2;
+  V x13 = x10 | x12;
+  V x14 = x4 & x5;
+  V x15 = a1 & ~a2;
+  V x16 = x14 | x15;
+  V x17 = a5 & x16;
+  V x18 = x13 ^ x17;
+  V x19 = x18 & ~a3;
+  V x20 = x9 ^ x19;
+  V x21 = a3 ^ a6;
+  V x22 = a5 & x21;
+  V x23 = a4 ^ x22;
+  V x24 = ~x9;
+  V x25 = x24 & ~a6;
+  V x26 = x20 | x25;
+  V x27 = a1 & x26;
+  V x28 = x23 ^ x27;
+  V x29 = x1 ^ x28;
+  V x30 = x29 & ~a4;
+  V x31 = x26 ^ x30;
+  V x32 = x2 & ~x7;
+  V x33 = a3 & x32;
+  V x34 = x31 ^ x33;
+  V x35 = a2 & x34;
+  V x36 = x28 ^ x35;
+  V x37 = ~x30;
+  V x38 = a3 & x37;
+  V x39 = x23 ^ x38;
+  V x40 = a6 & ~a3;
+  V x41 = x18 ^ x40;
+  V x42 = x41 & ~a2;
+  V x43 = x39 ^ x42;
+  V x44 = a2 | x37;
+  V x45 = x20 | x38;
+  V x46 = a6 | x45;
+  V x47 = x44 & x46;
+  V x48 = a1 & x47;
+  V x49 = x43 ^ x48;
+  V x50 = x45 & ~a2;
+  V x51 = x27 ^ x50;
+  V x52 = x23 & ~x42;
+  V x53 = x52 & ~a1;
+  V x54 = x34 ^ x53;
+  V x55 = a4 & x54;
+  V x56 = x51 ^ x55;
+  V x57 = ~x13;
+  V x58 = a6 & x50;
+  V x59 = x17 ^ x58;
+  V x60 = a1 & x59;
+  V x61 = x57 ^ x60;
+  V x62 = x61 & ~a3;
+  V x63 = x56 ^ x62;
+  *out1 ^= x20;
+  *out2 ^= x49;
+  *out3 ^= x63;
+  *out4 ^= x36;
+}
+
+/* S2, 57 gates */
+template <class V>
+static inline void bitslice_s2(V a1, V a2, V a3, V a4, V a5, V a6, V *out1,
+                               V *out2, V *out3, V *out4) {
+  V x1 = a1 ^ a5;
+  V x2 = a2 & ~a6;
+  V x3 = x1 ^ x2;
+  V x4 = ~x2;
+  V x5 = a1 & a5;
+  V x6 = x4 | x5;
+  V x7 = x6 & ~a4;
+  V x8 = x3 ^ x7;
+  V x9 = a5 & ~x7;
+  V x10 = a6 & ~x9;
+  V x11 = x2 ^ x6;
+  V x12 = a2 & x11;
+  V x13 = x10 ^ x12;
+  V x14 = x13 & ~a3;
+  V x15 = x8 ^ x14;
+  V x16 = a4 ^ x13;
+  V x17 = a3 & a5;
+  V x18 = x16 ^ x17;
+  V x19 = ~a3;
+  V x20 = x3 | x18;
+  V x21 = a2 & x20;
+  V x22 = x19 ^ x21;
+  V x23 = x22 & ~a6;
+  V x24 = x18 ^ x23;
+  V x25 = a5 | x23;
+  V x26 = x19 ^ x24;
+  V x27 = a2 & x26;
+  V x28 = x25 ^ x27;
+  V x29 = a6 ^ x25;
+  V x30 = a4 & ~x29;
+  V x31 = x28 & ~x30;
+  V x32 = a1 & x31;
+  V x33 = x24 ^ x32;
+  V x34 = x7 ^ x22;
+  V x35 = x24 & ~a5;
+  V x36 = a6 ^ x35;
+  V x37 = x36 & ~a1;
+  V x38 = x34 ^ x37;
+  V x39 = x8 & ~a4;
+  V x40 = x33 ^ x39;
+  V x41 = a1 & x24;
+  V x42 = a5 & ~x41;
+  V x43 = x40 & ~x42;
+  V x44 = x43 & ~a2;
+  V x45 = x38 ^ x44;
+  V x46 = x1 | x28;
+  V x47 = x46 & ~a6;
+  V x48 = x16 ^ x47;
+  V x49 = x43 & ~x13;
+  V x50 = x49 & ~a4;
+  V x51 = x48 ^ x50;
+  V x52 = x8 ^ x33;
+  V x53 = x2 | x32;
+  V x54 = x53 & ~a5;
+  V x55 = x52 ^ x54;
+  V x56 = x55 & ~a3;
+  V x57 = x51 ^ x56;
+  *out1 ^= x45;
+  *out2 ^= x15;
+  *out3 ^= x57;
+  *out4 ^= x33;
+}
+
+/* S3, 59 gates */
+template <class V>
+static inline void bitslice_s3(V a1, V a2, V a3, V a4, V a5, V a6, V *out1,
+                               V *out2, V *out3, V *out4) {
+  V x1 = a1 & a4;
+  V x2 = a3 ^ x1;
+  V x3 = a1 | a4;
+  V x4 = x3 & ~a6;
+  V x5 = x2 ^ x4;
+  V x6 = ~a4;
+  V x7 = x6 & ~a1;
+  V x8 = a3 | x7;
+  V x9 = x8 & ~a2;
+  V x10 = x5 ^ x9;
+  V x11 = x2 ^ x6;
+  V x12 = a6 & x3;
+  V x13 = x11 | x12;
+  V x14 = ~a6;
+  V x15 = a2 & x14;
+  V x16 = x13 | x15;
+  V x17 = a5 & x16;
+  V x18 = x10 ^ x17;
+  V x19 = a2 ^ x2;
+  V x20 = x6 & ~x10;
+  V x21 = a1 & x20;
+  V x22 = a5 ^ x21;
+  V x23 = a6 & x22;
+  V x24 = x19 ^ x23;
+  V x25 = x11 ^ x14;
+  V x26 = a2 & a1;
+  V x27 = x25 | x26;
+  V x28 = a1 & ~a3;
+  V x29 = x27 ^ x28;
+  V x30 = x29 & ~a5;
+  V x31 = x24 ^ x30;
+  V x32 = x2 | x23;
+  V x33 = a5 & x32;
+  V x34 = x25 ^ x33;
+  V x35 = x4 | x6;
+  V x36 = x35 & ~a2;
+  V x37 = x34 ^ x36;
+  V x38 = a5 & x4;
+  V x39 = x6 ^ x38;
+  V x40 = x20 ^ x24;
+  V x41 = x15 & ~a5;
+  V x42 = x40 ^ x41;
+  V x43 = x42 & ~a3;
+  V x44 = x39 ^ x43;
+  V x45 = x44 & ~a1;
+  V x46 = x37 ^ x45;
+  V x47 = x13 ^ x44;
+  V x48 = a2 & x47;
+  V x49 = x25 ^ x48;
+  V x50 = x47 & ~x43;
+  V x51 = a1 & x50;
+  V x52 = x49 ^ x51;
+  V x53 = x11 & ~a2;
+  V x54 = a3 ^ x53;
+  V x55 = x3 ^ x20;
+  V x56 = x55 & ~a6;
+  V x57 = x54 ^ x56;
+  V x58 = x57 & ~a5;
+  V x59 = x52 ^ x58;
+  *out1 ^= x18;
+  *out2 ^= x46;
+  *out3 ^= x59;
+  *out4 ^= x31;
+}
+
+/* S4, 58 gates */
+template <class V>
+static inline void bitslice_s4(V a1, V a2, V a3, V a4, V a5, V a6, V *out1,
+                               V *out2, V *out3, V *out4) {
+  V x1 = ~a5;
+  V x2 = a4 & a2;
+  V x3 = x1 ^ x2;
+  V x4 = a4 | a5;
+  V x5 = a3 & ~x3;
+  V x6 = x4 & ~x5;
+  V x7 = a1 & x6;
+  V x8 = x3 ^ x7;
+  V x9 = a3 ^ x4;
+  V x10 = a1 & a1;
+  V x11 = x9 | x10;
+  V x12 = x11 & ~a2;
+  V x13 = x8 ^ x12;
+  V x14 = a2 ^ x5;
+  V x15 = ~x6;
+  V x16 = a2 & x15;
+  V x17 = a4 ^ x16;
+  V x18 = a1 & x17;
+  V x19 = x14 ^ x18;
+  V x20 = a4 | x8;
+  V x21 = x20 & ~a3;
+  V x22 = x19 ^ x21;
+  V x23 = x13 & ~a6;
+  V x24 = x22 & a6;
+  V x25 = x23 | x24;
+  V x26 = ~x13;
+  V x27 = x22 ^ x26;
+  V x28 = x27 & ~a6;
+  V x29 = x26 ^ x28;
+  V x30 = a2 & ~x24;
+  V x31 = x1 | x23;
+  V x32 = a1 & x31;
+  V x33 = x30 ^ x32;
+  V x34 = x18 | x29;
+  V x35 = x34 & ~a4;
+  V x36 = x33 ^ x35;
+  V x37 = x25 ^ x29;
+  V x38 = a6 ^ x29;
+  V x39 = a1 & x38;
+  V x40 = x37 ^ x39;
+  V x41 = x1 & ~x38;
+  V x42 = x40 & ~a2;
+  V x43 = x41 & a2;
+  V x44 = x42 | x43;
+  V x45 = x44 & ~a3;
+  V x46 = x36 ^ x45;
+  V x47 = x9 ^ x46;
+  V x48 = a2 & x17;
+  V x49 = x47 ^ x48;
+  V x50 = ~a1;
+  V x51 = x50 & ~a6;
+  V x52 = x49 ^ x51;
+  V x53 = a6 ^ x19;
+  V x54 = x15 | x45;
+  V x55 = x54 & ~a5;
+  V x56 = x53 ^ x55;
+  V x57 = a1 & x56;
+  V x58 = x52 ^ x57;
+  *out1 ^= x58;
+  *out2 ^= x46;
+  *out3 ^= x29;
+  *out4 ^= x25;
+}
+
+/* S5, 63 gates */
+template <class V>
+static inline void bitslice_s5(V a1, V a2, V a3, V a4, V a5, V a6, V *out1,
+                               V *out2, V *out3, V *out4) {
+  V x1 = a2 & a4;
+  V x2 = a5 ^ x1;
+  V x3 = a2 | a4;
+  V x4 = x3 & ~a6;
+  V x5 = x2 ^ x4;
+  V x6 = ~x3;
+  V x7 = a4 | a6;
+  V x8 = x7 & ~a5;
+  V x9 = x6 ^ x8;
+  V x10 = x9 & ~a3;
+  V x11 = x5 ^ x10;
+  V x12 = a6 ^ x9;
+  V x13 = a4 & a3;
+  V x14 = x12 | x13;
+  V x15 = a4 ^ x4;
+  V x16 = x15 & ~a3;
+  V x17 = x14 ^ x16;
+  V x18 = x17 & ~a1;
+  V x19 = x11 ^ x18;
+  V x20 = a2 | x12;
+  V x21 = x20 & ~a3;
+  V x22 = x9 ^ x21;
+  V x23 = a6 & x20;
+  V x24 = x19 ^ x23;
+  V x25 = x24 & ~a1;
+  V x26 = x22 ^ x25;
+  V x27 = x10 | x24;
+  V x28 = x4 & ~x19;
+  V x29 = a2 & x28;
+  V x30 = x27 ^ x29;
+  V x31 = x28 & ~a2;
+  V x32 = a6 ^ x31;
+  V x33 = a1 & x32;
+  V x34 = x30 ^ x33;
+  V x35 = a4 & x34;
+  V x36 = x26 ^ x35;
+  V x37 = a3 ^ a5;
+  V x38 = a6 & ~a4;
+  V x39 = x37 ^ x38;
+  V x40 = a5 | x22;
+  V x41 = a2 & x40;
+  V x42 = x39 ^ x41;
+  V x43 = x4 ^ x27;
+  V x44 = a4 & x11;
+  V x45 = x43 | x44;
+  V x46 = x36 & ~a2;
+  V x47 = x24 ^ x46;
+  V x48 = a3 & x47;
+  V x49 = x45 ^ x48;
+  V x50 = x49 & ~a1;
+  V x51 = x42 ^ x50;
+  V x52 = a3 ^ x34;
+  V x53 = x52 & ~a6;
+  V x54 = x12 ^ x53;
+  V x55 = a3 & x2;
+  V x56 = a2 & x55;
+  V x57 = x54 ^ x56;
+  V x58 = x3 & x42;
+  V x59 = a2 | x6;
+  V x60 = a6 & x59;
+  V x61 = x58 | x60;
+  V x62 = x61 & ~a1;
+  V x63 = x57 ^ x62;
+  *out1 ^= x36;
+  *out2 ^= x19;
+  *out3 ^= x51;
+  *out4 ^= x63;
+}
+
+/* S6, 58 gates */
+template <class V>
+static inline void bitslice_s6(V a1, V a2, V a3, V a4, V a5, V a6, V *out1,
+                               V *out2, V *out3, V *out4) {
+  V x1 = a4 ^ a6;
+  V x2 = a1 & a1;
+  V x3 = x1 ^ x2;
+  V x4 = a1 & a4;
+  V x5 = a3 ^ x4;
+  V x6 = ~x3;
+  V x7 = x6 & ~a6;
+  V x8 = x5 | x7;
+  V x9 = x8 & ~a5;
+  V x10 = x3 ^ x9;
+  V x11 = a6 & ~x3;
+  V x12 = a5 & ~a4;
+  V x13 = x11 & ~x12;
+  V x14 = a5 | x10;
+  V x15 = x14 & ~a3;
+  V x16 = x13 | x15;
+  V x17 = a2 & x16;
+  V x18 = x10 ^ x17;
+  V x19 = a1 ^ a6;
+  V x20 = ~x13;
+  V x21 = a5 & x20;
+  V x22 = x19 ^ x21;
+  V x23 = x12 & ~a1;
+  V x24 = x8 ^ x23;
+  V x25 = a3 & x24;
+  V x26 = x22 ^ x25;
+  V x27 = a6 | x14;
+  V x28 = a5 & ~x3;
+  V x29 = a3 & a1;
+  V x30 = x28 | x29;
+  V x31 = a4 & ~x30;
+  V x32 = x27 & ~x31;
+  V x33 = x32 & ~a2;
+  V x34 = x26 ^ x33;
+  V x35 = a2 ^ x3;
+  V x36 = x18 & ~a1;
+  V x37 = x10 ^ x36;
+  V x38 = x37 & ~a3;
+  V x39 = x35 ^ x38;
+  V x40 = x37 & ~x8;
+  V x41 = x11 & ~a2;
+  V x42 = x40 ^ x41;
+  V x43 = x34 & ~a6;
+  V x44 = a3 ^ x43;
+  V x45 = a3 & x44;
+  V x46 = x42 ^ x45;
+  V x47 = a5 & x46;
+  V x48 = x39 ^ x47;
+  V x49 = x21 ^ x45;
+  V x50 = a3 ^ x10;
+  V x51 = a1 & x50;
+  V x52 = x49 ^ x51;
+  V x53 = x11 | x45;
+  V x54 = x9 | x15;
+  V x55 = a4 & x54;
+  V x56 = x53 ^ x55;
+  V x57 = a2 & x56;
+  V x58 = x52 ^ x57;
+  *out1 ^= x18;
+  *out2 ^= x34;
+  *out3 ^= x48;
+  *out4 ^= x58;
+}
+
+/* S7, 58 gates */
+template <class V>
+static inline void bitslice_s7(V a1, V a2, V a3, V a4, V a5, V a6, V *out1,
+                               V *out2, V *out3, V *out4) {
+  V x1 = a2 ^ a4;
+  V x2 = a3 & ~a6;
+  V x3 = x1 ^ x2;
+  V x4 = a4 | a6;
+  V x5 = a3 ^ a4;
+  V x6 = x5 & ~a2;
+  V x7 = x4 ^ x6;
+  V x8 = a5 & x7;
+  V x9 = x3 ^ x8;
+  V x10 = a5 | x7;
+  V x11 = x3 | x8;
+  V x12 = x11 & ~a6;
+  V x13 = x10 ^ x12;
+  V x14 = a6 | x8;
+  V x15 = a3 & x4;
+  V x16 = x14 ^ x15;
+  V x17 = a2 & x16;
+  V x18 = x13 ^ x17;
+  V x19 = x18 & ~a1;
+  V x20 = x9 ^ x19;
+  V x21 = x13 & ~x17;
+  V x22 = a3 & a4;
+  V x23 = x20 | x22;
+  V x24 = x23 & ~a1;
+  V x25 = x21 ^ x24;
+  V x26 = ~x6;
+  V x27 = x9 ^ x18;
+  V x28 = a6 & x27;
+  V x29 = x16 ^ x28;
+  V x30 = a1 & x29;
+  V x31 = x26 ^ x30;
+  V x32 = a5 & x31;
+  V x33 = x25 ^ x32;
+  V x34 = x12 ^ x33;
+  V x35 = a1 | x7;
+  V x36 = x35 & ~a5;
+  V x37 = x34 ^ x36;
+  V x38 = x12 | x30;
+  V x39 = a2 & x38;
+  V x40 = x37 ^ x39;
+  V x41 = a5 | x2;
+  V x42 = a2 & x41;
+  V x43 = x29 ^ x42;
+  V x44 = a1 & ~x2;
+  V x45 = x43 & ~x44;
+  V x46 = a3 & x45;
+  V x47 = x40 ^ x46;
+  V x48 = a3 ^ x47;
+  V x49 = x48 & ~a1;
+  V x50 = x27 ^ x49;
+  V x51 = a3 & x44;
+  V x52 = a2 & x51;
+  V x53 = x50 ^ x52;
+  V x54 = a5 ^ x26;
+  V x55 = x54 & ~a1;
+  V x56 = x17 ^ x55;
+  V x57 = x56 & ~a4;
+  V x58 = x53 ^ x57;
+  *out1 ^= x20;
+  *out2 ^= x58;
+  *out3 ^= x33;
+  *out4 ^= x47;
+}
+
+/* S8, 55 gates */
+template <class V>
+static inline void bitslice_s8(V a1, V a2, V a3, V a4, V a5, V a6, V *out1,
+                               V *out2, V *out3, V *out4) {
+  V x1 = a4 ^ a6;
+  V x2 = a3 & ~a2;
+  V x3 = x1 ^ x2;
+  V x4 = a6 | x2;
+  V x5 = a1 & ~x4;
+  V x6 = x3 & ~x5;
+  V x7 = a2 & ~a4;
+  V x8 = a1 | x7;
+  V x9 = x8 & ~a5;
+  V x10 = x6 ^ x9;
+  V x11 = a1 & ~a2;
+  V x12 = x5 ^ x11;
+  V x13 = ~x5;
+  V x14 = x13 & ~a5;
+  V x15 = x12 ^ x14;
+  V x16 = x15 & ~a3;
+  V x17 = x10 ^ x16;
+  V x18 = a1 ^ a3;
+  V x19 = a4 ^ x13;
+  V x20 = x19 & ~a5;
+  V x21 = x18 ^ x20;
+  V x22 = x7 | x14;
+  V x23 = a2 & x22;
+  V x24 = x21 ^ x23;
+  V x25 = a2 ^ x17;
+  V x26 = x15 & x24;
+  V x27 = a4 & x26;
+  V x28 = x25 ^ x27;
+  V x29 = a6 & x28;
+  V x30 = x24 ^ x29;
+  V x31 = x19 ^ x26;
+  V x32 = a6 & x21;
+  V x33 = x32 & ~a4;
+  V x34 = a5 ^ x33;
+  V x35 = a2 & x34;
+  V x36 = x31 ^ x35;
+  V x37 = x16 ^ x21;
+  V x38 = a5 & x31;
+  V x39 = a4 ^ x38;
+  V x40 = x39 & ~a6;
+  V x41 = x37 ^ x40;
+  V x42 = a1 & x41;
+  V x43 = x36 ^ x42;
+  V x44 = ~x24;
+  V x45 = x28 & ~a2;
+  V x46 = x38 | x45;
+  V x47 = x46 & ~a6;
+  V x48 = x44 ^ x47;
+  V x49 = x37 & ~a2;
+  V x50 = x20 ^ x49;
+  V x51 = x12 | x20;
+  V x52 = x51 & ~a6;
+  V x53 = x50 ^ x52;
+  V x54 = a1 & x53;
+  V x55 = x48 ^ x54;
+  *out1 ^= x55;
+  *out2 ^= x17;
+  *out3 ^= x43;
+  *out4 ^= x30;
+}
+
+/* left ^= f(right, key). Expansion and P are register renaming: the   *
+ * planes each S-box reads and writes are spelled out from E and P.     */
+template <class V>
+static inline void bitslice_round(const V right[32], V left[32],
+                                  const uint64_t key[48]) {
+  bitslice_s1(right[31] ^ key[0], right[0] ^ key[1], right[1] ^ key[2],
+              right[2] ^ key[3], right[3] ^ key[4], right[4] ^ key[5], &left[8],
+              &left[16], &left[22], &left[30]);
+  bitslice_s2(right[3] ^ key[6], right[4] ^ key[7], right[5] ^ key[8],
+              right[6] ^ key[9], right[7] ^ key[10], right[8] ^ key[11],
+              &left[12], &left[27], &left[1], &left[17]);
+  bitslice_s3(right[7] ^ key[12], right[8] ^ key[13], right[9] ^ key[14],
+              right[10] ^ key[15], right[11] ^ key[16], right[12] ^ key[17],
+              &left[23], &left[15], &left[29], &left[5]);
+  bitslice_s4(right[11] ^ key[18], right[12] ^ key[19], right[13] ^ key[20],
+              right[14] ^ key[21], right[15] ^ key[22], right[16] ^ key[23],
+              &left[25], &left[19], &left[9], &left[0]);
+  bitslice_s5(right[15] ^ key[24], right[16] ^ key[25], right[17] ^ key[26],
+              right[18] ^ key[27], right[19] ^ key[28], right[20] ^ key[29],
+              &left[7], &left[13], &left[24], &left[2]);
+  bitslice_s6(right[19] ^ key[30], right[20] ^ key[31], right[21] ^ key[32],
+              right[22] ^ key[33], right[23] ^ key[34], right[24] ^ key[35],
+              &left[3], &left[28], &left[10], &left[18]);
+  bitslice_s7(right[23] ^ key[36], right[24] ^ key[37], right[25] ^ key[38],
+              right[26] ^ key[39], right[27] ^ key[40], right[28] ^ key[41],
+              &left[31], &left[11], &left[21], &left[6]);
+  bitslice_s8(right[27] ^ key[42], right[28] ^ key[43], right[29] ^ key[44],
+              right[30] ^ key[45], right[31] ^ key[46], right[0] ^ key[47],
+              &left[4], &left[26], &left[14], &left[20]);
+}
+
+/* One DES pass of 16 rounds, the order of the round keys fixed by       *
+ * forward. Rounds alternate between the halves instead of swapping      *
+ * them, so the pass leaves the halves in reverse order.                 */
+template <class V, bool forward>
+static inline void bitslice_pass(V left[32], V right[32],
+                                 const uint64_t masks[NUM_ROUNDS][48]) {
+  int round;
+  for (round = 0; round < NUM_ROUNDS; round += 2) {
+    bitslice_round(right, left,
+                   masks[forward ? round : (NUM_ROUNDS - 1) - round]);
+    bitslice_round(left, right,
+                   masks[forward ? round + 1 : (NUM_ROUNDS - 2) - round]);
+  }
+}
+
+/* Triple DES EDE in one direction over num_batches full batches. The   *
+ * FP/IP pairs between the three passes cancel, leaving only a swap of  *
+ * the halves, which the passes absorb by trading places.               */
+template <class V, bool decrypting>
+static void bitslice_ede3(uint8_t *out, const uint8_t *in,
+                          size_t num_batches, const bitslice_keys *keys) {
+  const size_t BATCH_SIZE = sizeof(V) * 8 * BLOCK_SIZE;
+
+  size_t batch;
+  for (batch = 0; batch < num_batches; batch++) {
+    V planes[BITSLICE_PLANES], state[BITSLICE_PLANES];
+
+    bitslice_load(in + (batch * BATCH_SIZE), planes);
+
+    int i;
+    for (i = 0; i < BITSLICE_PLANES; i++) {
+      state[i] = planes[BITSLICE_TABLES.ip[i]];
+    }
+
+    V *left = state, *right = state + 32;
+
+    bitslice_pass<V, !decrypting>(left, right,
+                                  keys->masks[decrypting ? 2 : 0]);
+    bitslice_pass<V, decrypting>(right, left, keys->masks[1]);
+    bitslice_pass<V, !decrypting>(left, right,
+                                  keys->masks[decrypting ? 0 : 2]);
+
+    /* The three passes leave the halves in reverse order */
+    for (i = 0; i < BITSLICE_PLANES; i++) {
+      uint8_t bit = BITSLICE_TABLES.fp[i];
+      planes[i] = (bit < 32) ? right[bit] : left[bit - 32];
+    }
+
+    bitslice_store(planes, out + (batch * BATCH_SIZE));
+  }
+}
+
+/* Triple DES EDE over num_batches full batches from in to out, which may *
+ * be the same buffer. The direction is chosen once per call.             */
+template <class V>
+static void bitslice_crypt(uint8_t *out, const uint8_t *in,
+                           size_t num_batches, const bitslice_keys *keys,
+                           bool decrypting) {
+  if (decrypting) {
+    bitslice_ede3<V, true>(out, in, num_batches, keys);
+  } else {
+    bitslice_ede3<V, false>(out, in, num_batches, keys);
+  }
+}
+
+#endif  // BITSLICE_IMPL_H_
@@ -0,0 +1,95 @@
+/*
+ *  Copyright (C) 2019 Zachary Mohling
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "chunk_ring.h"
+
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <new>
+
+ChunkRing::ChunkRing(uint8_t *buffer, uint32_t chunk_size,
+                     uint32_t num_slots)
+    : num_slots_(num_slots) {
+  void *memory;
+  if (posix_memalign(&memory, CACHE_LINE_SIZE,
+                     num_slots * sizeof(chunk_descriptor)) != 0) {
+    fprintf(stderr, "Insufficient memory. ERROR: %d\n", errno);
+    exit(-1);
+  }
+
+  slots_ = (chunk_descriptor *)memory;
+
+  uint32_t slot;
+  for (slot = 0; slot < num_slots; slot++) {
+    chunk_descriptor *chunk = new (&slots_[slot]) chunk_descriptor;
+    chunk->sequence.store(slot, std::memory_order_relaxed);
+    chunk->num_callbacks.store(0, std::memory_order_relaxed);
+    chunk->num_expected_callbacks = 0;
+    chunk->num_bytes = 0;
+    chunk->index = slot;
+    chunk->start_ns = 0;
+    chunk->data = buffer + ((uint64_t)slot * chunk_size);
+  }
+}
+
+ChunkRing::~ChunkRing() {
+  uint32_t slot;
+  for (slot = 0; slot < num_slots_; slot++) slots_[slot].~chunk_descriptor();
+
+  free(slots_);
+}
+
+chunk_descriptor *ChunkRing::try_acquire(uint64_t index) {
+  chunk_descriptor *chunk = &slots_[index % num_slots_];
+
+  if (chunk->sequence.load(std::memory_order_acquire) != index) return NULL;
+
+  chunk->index = index;
+  return chunk;
+}
+
+void ChunkRing::publish(chunk_descriptor *chunk, uint32_t num_bytes,
+                        uint32_t num_work_items) {
+  chunk->num_bytes = num_bytes;
+  chunk->num_expected_callbacks = num_work_items;
+  chunk->num_callbacks.store(0, std::memory_order_relaxed);
+
+  chunk->sequence.store(chunk->index + 1, std::memory_order_release);
+}
+
+chunk_descriptor *ChunkRing::try_complete(uint64_t index) {
+  chunk_descriptor *chunk = &slots_[index % num_slots_];
+
+  if (chunk->sequence.load(std::memory_order_acquire) != index + 1) {
+    return NULL;
+  }
+
+  if (chunk->num_callbacks.load(std::memory_order_acquire) !=
+      chunk->num_expected_callbacks) {
+    return NULL;
+  }
+
+  return chunk;
+}
+
+void ChunkRing::release(chunk_descriptor *chunk) {
+  chunk->sequence.store(chunk->index + num_slots_, std::memory_order_release);
+}
+
+uint32_t ChunkRing::num_slots() const { return num_slots_; }
@@ -0,0 +1,81 @@
+/*
+ *  Copyright (C) 2019 Zachary Mohling
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef CHUNK_RING_H_
+#define CHUNK_RING_H_
+
+#include <stdint.h>
+
+#include <atomic>
+
+#define CACHE_LINE_SIZE 64
+
+/* Descriptor of one slot of the circular buffer. Padded to a cache line *
+ * so that workers signalling one chunk never contend with the slot of   *
+ * another. start_ns is when the reader took the slot, for the latency   *
+ * of the chunk.                                                         *
+ *                                                                       *
+ * sequence tells who owns the slot. It equals the index of the next     *
+ * chunk that may be read into it while the slot is free, index + 1 once *
+ * chunk index has been read and its work items dispatched, and moves on *
+ * to index + num_slots when the chunk has been written out.             */
+typedef struct alignas(CACHE_LINE_SIZE) chunk_descriptor {
+  std::atomic<uint64_t> sequence;
+  std::atomic<uint32_t> num_callbacks;
+  uint32_t num_expected_callbacks;
+  uint32_t num_bytes;
+  uint64_t index;
+  uint64_t start_ns;
+  uint8_t *data;
+} chunk_descriptor;
+
+/* Fixed ring of chunk descriptors over a circular buffer, indexed by     *
+ * slot. The reader acquires and publishes slots in chunk order, workers  *
+ * bump num_callbacks once per work item, and the writer completes and    *
+ * releases slots in chunk order. All coordination is through the atomic *
+ * fields; nothing is locked or allocated after construction.            */
+class ChunkRing {
+ public:
+  ChunkRing(uint8_t *buffer, uint32_t chunk_size, uint32_t num_slots);
+
+  ~ChunkRing();
+
+  /* Descriptor for chunk index if its slot is free, NULL otherwise */
+  chunk_descriptor *try_acquire(uint64_t index);
+
+  /* Hand an acquired chunk over to its work items and the writer */
+  void publish(chunk_descriptor *chunk, uint32_t num_bytes,
+               uint32_t num_work_items);
+
+  /* Descriptor for chunk index once all its work items have called back, *
+   * NULL otherwise                                                       */
+  chunk_descriptor *try_complete(uint64_t index);
+
+  /* Return a written chunk's slot to the reader */
+  void release(chunk_descriptor *chunk);
+
+  uint32_t num_slots() const;
+
+ private:
+  chunk_descriptor *slots_;
+  uint32_t num_slots_;
+
+  ChunkRing(const ChunkRing &);
+  ChunkRing &operator=(const ChunkRing &);
+};
+
+#endif  // CHUNK_RING_H_
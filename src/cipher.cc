@@ -26,84 +26,272 @@
 #include <iostream>
 #include <vector>
 
+#include "permutation.h"
+
 /* Prototypes */
 static void bytes_to_bitset48(const uint8_t *bytes, std::bitset<48> *b);
 
-/* Initial purmutation */
-const uint8_t IP[] = {58, 50, 42, 34, 26, 18, 10, 2,  60, 52, 44, 36, 28,
-                      20, 12, 4,  62, 54, 46, 38, 30, 22, 14, 6,  64, 56,
-                      48, 40, 32, 24, 16, 8,  57, 49, 41, 33, 25, 17, 9,
-                      1,  59, 51, 43, 35, 27, 19, 11, 3,  61, 53, 45, 37,
-                      29, 21, 13, 5,  63, 55, 47, 39, 31, 23, 15, 7};
-
-/* Final purmutation */
-const uint8_t FP[] = {40, 8,  48, 16, 56, 24, 64, 32, 39, 7,  47, 15, 55,
-                      23, 63, 31, 38, 6,  46, 14, 54, 22, 62, 30, 37, 5,
-                      45, 13, 53, 21, 61, 29, 36, 4,  44, 12, 52, 20, 60,
-                      28, 35, 3,  43, 11, 51, 19, 59, 27, 34, 2,  42, 10,
-                      50, 18, 58, 26, 33, 1,  41, 9,  49, 17, 57, 25};
-
-/* Expansion function */
-const uint8_t E[] = {32, 1,  2,  3,  4,  5,  4,  5,  6,  7,  8,  9,
-                     8,  9,  10, 11, 12, 13, 12, 13, 14, 15, 16, 17,
-                     16, 17, 18, 19, 20, 21, 20, 21, 22, 23, 24, 25,
-                     24, 25, 26, 27, 28, 29, 28, 29, 30, 31, 32, 1};
-
-/* Permutation */
-const uint8_t P[] = {16, 7, 20, 21, 29, 12, 28, 17, 1,  15, 23,
-                     26, 5, 18, 31, 10, 2,  8,  24, 14, 32, 27,
-                     3,  9, 19, 13, 30, 6,  22, 11, 4,  25};
-
-/* Substitution boxes */
-const uint8_t S1[] = {14, 4,  13, 1, 2,  15, 11, 8,  3,  10, 6,  12, 5,
-                      9,  0,  7,  0, 15, 7,  4,  14, 2,  13, 1,  10, 6,
-                      12, 11, 9,  5, 3,  8,  4,  1,  14, 8,  13, 6,  2,
-                      11, 15, 12, 9, 7,  3,  10, 5,  0,  15, 12, 8,  2,
-                      4,  9,  1,  7, 5,  11, 3,  14, 10, 0,  6,  13};
-
-const uint8_t S2[] = {15, 1,  8,  14, 6,  11, 3, 4,  9,  7,  2,  13, 12,
-                      0,  5,  10, 3,  13, 4,  7, 15, 2,  8,  14, 12, 0,
-                      1,  10, 6,  9,  11, 5,  0, 14, 7,  11, 10, 4,  13,
-                      1,  5,  8,  12, 6,  9,  3, 2,  15, 13, 8,  10, 1,
-                      3,  15, 4,  2,  11, 6,  7, 12, 0,  5,  14, 9};
-
-const uint8_t S3[] = {10, 0,  9,  14, 6,  3,  15, 5,  1,  13, 12, 7,  11,
-                      4,  2,  8,  13, 7,  0,  9,  3,  4,  6,  10, 2,  8,
-                      5,  14, 12, 11, 15, 1,  13, 6,  4,  9,  8,  15, 3,
-                      0,  11, 1,  2,  12, 5,  10, 14, 7,  1,  10, 13, 0,
-                      6,  9,  8,  7,  4,  15, 14, 3,  11, 5,  2,  12};
-
-const uint8_t S4[] = {7,  13, 14, 3,  0,  6,  9,  10, 1,  2, 8,  5,  11,
-                      12, 4,  15, 13, 8,  11, 5,  6,  15, 0, 3,  4,  7,
-                      2,  12, 1,  10, 14, 9,  10, 6,  9,  0, 12, 11, 7,
-                      13, 15, 1,  3,  14, 5,  2,  8,  4,  3, 15, 0,  6,
-                      10, 1,  13, 8,  9,  4,  5,  11, 12, 7, 2,  14};
-
-const uint8_t S5[] = {2,  12, 4, 1,  7,  10, 11, 6, 8,  5,  3,  15, 13,
-                      0,  14, 9, 14, 11, 2,  12, 4, 7,  13, 1,  5,  0,
-                      15, 10, 3, 9,  8,  6,  4,  2, 1,  11, 10, 13, 7,
-                      8,  15, 9, 12, 5,  6,  3,  0, 14, 11, 8,  12, 7,
-                      1,  14, 2, 13, 6,  15, 0,  9, 10, 4,  5,  3};
-
-const uint8_t S6[] = {12, 1,  10, 15, 9,  2,  6,  8,  0,  13, 3, 4, 14,
-                      7,  5,  11, 10, 15, 4,  2,  7,  12, 9,  5, 6, 1,
-                      13, 14, 0,  11, 3,  8,  9,  14, 15, 5,  2, 8, 12,
-                      3,  7,  0,  4,  10, 1,  13, 11, 6,  4,  3, 2, 12,
-                      9,  5,  15, 10, 11, 14, 1,  7,  6,  0,  8, 13};
-
-const uint8_t S7[] = {4,  11, 2,  14, 15, 0,  8, 13, 3,  12, 9,  7,  5,
-                      10, 6,  1,  13, 0,  11, 7, 4,  9,  1,  10, 14, 3,
-                      5,  12, 2,  15, 8,  6,  1, 4,  11, 13, 12, 3,  7,
-                      14, 10, 15, 6,  8,  0,  5, 9,  2,  6,  11, 13, 8,
-                      1,  4,  10, 7,  9,  5,  0, 15, 14, 2,  3,  12};
-
-const uint8_t S8[] = {13, 2,  8, 4,  6,  15, 11, 1,  10, 9, 3, 14, 5,
-                      0,  12, 7, 1,  15, 13, 8,  10, 3,  7, 4, 12, 5,
-                      6,  11, 0, 14, 9,  2,  7,  11, 4,  1, 9, 12, 14,
-                      2,  0,  6, 10, 13, 15, 3,  5,  8,  2, 1, 14, 7,
-                      4,  10, 8, 13, 15, 12, 9,  0,  3,  5, 6, 11};
-
-Cipher::Cipher() {}
+static constexpr uint32_t rotate_left(uint32_t word, unsigned bits) {
+  return (word << bits) | (word >> (32 - bits));
+}
+
+/* Byte-indexed tables of IP and FP for the table engine, and of P for *
+ * building the SP tables.                                             */
+static constexpr Permutation ip_table(BLOCK_SIZE, BLOCK_SIZE, IP);
+static constexpr Permutation fp_table(BLOCK_SIZE, BLOCK_SIZE, FP);
+static constexpr Permutation p_table(BLOCK_SIZE / 2, BLOCK_SIZE / 2, P);
+
+static_assert(fp_table.apply(ip_table.apply(0x0123456789ABCDEF)) ==
+                  0x0123456789ABCDEF,
+              "FP must invert IP");
+
+/* Combined substitution and permutation tables. box[i][x] is P applied *
+ * to the output of S-box i+1 for the 6-bit input x, placed in its      *
+ * nibble of the 32-bit half. Entries are rotated left by one bit,      *
+ * matching the rotated halves the table engine keeps in its registers. */
+typedef struct sp_tables {
+  uint32_t box[NUM_SUB_BOXES][64];
+} sp_tables;
+
+static constexpr sp_tables make_sp_tables() {
+  sp_tables tables = {};
+
+  for (int i = 0; i < NUM_SUB_BOXES; i++) {
+    for (unsigned x = 0; x < 64; x++) {
+      uint32_t nibble = sbox_lookup(i, x);
+      tables.box[i][x] =
+          rotate_left(p_table.apply(nibble << (28 - (i * 4))), 1);
+    }
+  }
+
+  return tables;
+}
+
+static constexpr sp_tables SP = make_sp_tables();
+
+Cipher::Cipher() : Cipher(ENGINE_TABLE) {}
+
+Cipher::Cipher(Engine engine) : engine_(engine) {}
+
+Cipher::Engine Cipher::engine() const { return engine_; }
+
+void Cipher::set_engine(Engine engine) { engine_ = engine; }
+
+/* Feistel function of the table engine. The half is kept rotated left by *
+ * one bit, which lines up every 6-bit window of the expansion E on a byte *
+ * boundary of either the half or the half rotated right by four.          */
+static inline uint32_t sp_feistel(uint32_t right, const uint32_t *key) {
+  uint32_t work = ((right >> 4) | (right << 28)) ^ key[0];
+  uint32_t out = SP.box[6][work & 0x3F] ^ SP.box[4][(work >> 8) & 0x3F] ^
+                 SP.box[2][(work >> 16) & 0x3F] ^
+                 SP.box[0][(work >> 24) & 0x3F];
+
+  work = right ^ key[1];
+  out ^= SP.box[7][work & 0x3F] ^ SP.box[5][(work >> 8) & 0x3F] ^
+         SP.box[3][(work >> 16) & 0x3F] ^ SP.box[1][(work >> 24) & 0x3F];
+
+  return out;
+}
+
+/* IP, then split into the rotated halves used by the table engine. */
+static inline void initial_permutation(const uint8_t *in, uint32_t *left,
+                                       uint32_t *right) {
+  uint64_t permuted = ip_table.apply(Permutation::load(in, BLOCK_SIZE));
+
+  *left = rotate_left(permuted >> 32, 1);
+  *right = rotate_left(permuted & 0xFFFFFFFF, 1);
+}
+
+/* Undo the rotation, combine the halves and apply FP. */
+static inline void final_permutation(uint32_t left, uint32_t right,
+                                     uint8_t *out) {
+  uint64_t combined = ((uint64_t)rotate_left(left, 31) << 32) |
+                      rotate_left(right, 31);
+
+  Permutation::store(fp_table.apply(combined), out, BLOCK_SIZE);
+}
+
+/* Number of blocks the table engine carries through the rounds side by *
+ * side. Their rounds are independent, so the lookups of one block hide  *
+ * the latency of the others.                                            */
+#define INTERLEAVE 4
+
+/* One DES pass over N blocks, the order of the round keys fixed at     *
+ * compile time by forward, so the round body holds no branches. Rounds *
+ * alternate between the two halves instead of swapping them, so the    *
+ * halves never leave their registers. The pass leaves the halves in    *
+ * reverse order. The loop is kept rather than expanded: sixteen        *
+ * expanded rounds of INTERLEAVE blocks outgrow the instruction cache.  */
+template <int N, bool forward>
+static inline void table_pass(uint32_t left[N], uint32_t right[N],
+                              const uint32_t split_keys[NUM_ROUNDS][2]) {
+  int round, i;
+  for (round = 0; round < NUM_ROUNDS; round += 2) {
+    const uint32_t *first = split_keys[forward ? round : 15 - round];
+    const uint32_t *second = split_keys[forward ? round + 1 : 14 - round];
+
+    for (i = 0; i < N; i++) left[i] ^= sp_feistel(right[i], first);
+    for (i = 0; i < N; i++) right[i] ^= sp_feistel(left[i], second);
+  }
+}
+
+/* DES over N consecutive blocks with the table engine. */
+template <int N, bool decrypting>
+static inline void table_des(uint8_t *out, const uint8_t *in,
+                             const uint32_t split_keys[NUM_ROUNDS][2]) {
+  uint32_t left[N], right[N];
+
+  int i;
+  for (i = 0; i < N; i++) {
+    initial_permutation(in + (i * BLOCK_SIZE), &left[i], &right[i]);
+  }
+
+  table_pass<N, !decrypting>(left, right, split_keys);
+
+  for (i = 0; i < N; i++) {
+    final_permutation(right[i], left[i], out + (i * BLOCK_SIZE));
+  }
+}
+
+/* Triple DES over N consecutive blocks: E(K1), D(K2), E(K3) or, when    *
+ * decrypting, D(K3), E(K2), D(K1). Each pass leaves its halves in       *
+ * reverse order, which is exactly where FP followed by IP would have    *
+ * put them, so the passes simply continue on the other half.            */
+template <int N, bool decrypting>
+static inline void table_ede3(uint8_t *out, const uint8_t *in,
+                              const uint32_t split_keys[3][NUM_ROUNDS][2]) {
+  uint32_t left[N], right[N];
+
+  int i;
+  for (i = 0; i < N; i++) {
+    initial_permutation(in + (i * BLOCK_SIZE), &left[i], &right[i]);
+  }
+
+  table_pass<N, !decrypting>(left, right, split_keys[decrypting ? 2 : 0]);
+  table_pass<N, decrypting>(right, left, split_keys[1]);
+  table_pass<N, !decrypting>(left, right, split_keys[decrypting ? 0 : 2]);
+
+  for (i = 0; i < N; i++) {
+    final_permutation(right[i], left[i], out + (i * BLOCK_SIZE));
+  }
+}
+
+/* DES over num_blocks blocks, INTERLEAVE at a time while they last. */
+template <bool decrypting>
+static void table_des_blocks(uint8_t *out, const uint8_t *in,
+                             size_t num_blocks,
+                             const uint32_t split_keys[NUM_ROUNDS][2]) {
+  for (; num_blocks >= INTERLEAVE; num_blocks -= INTERLEAVE) {
+    table_des<INTERLEAVE, decrypting>(out, in, split_keys);
+    in += INTERLEAVE * BLOCK_SIZE;
+    out += INTERLEAVE * BLOCK_SIZE;
+  }
+
+  for (; num_blocks > 0; num_blocks--) {
+    table_des<1, decrypting>(out, in, split_keys);
+    in += BLOCK_SIZE;
+    out += BLOCK_SIZE;
+  }
+}
+
+/* Triple DES over num_blocks blocks, INTERLEAVE at a time. */
+template <bool decrypting>
+static void table_ede3_blocks(uint8_t *out, const uint8_t *in,
+                              size_t num_blocks,
+                              const uint32_t split_keys[3][NUM_ROUNDS][2]) {
+  for (; num_blocks >= INTERLEAVE; num_blocks -= INTERLEAVE) {
+    table_ede3<INTERLEAVE, decrypting>(out, in, split_keys);
+    in += INTERLEAVE * BLOCK_SIZE;
+    out += INTERLEAVE * BLOCK_SIZE;
+  }
+
+  for (; num_blocks > 0; num_blocks--) {
+    table_ede3<1, decrypting>(out, in, split_keys);
+    in += BLOCK_SIZE;
+    out += BLOCK_SIZE;
+  }
+}
+
+void Cipher::encrypt(uint8_t *out, const uint8_t *in,
+                     const key_schedule *schedule) {
+  if (engine_ == ENGINE_TABLE) {
+    table_des_blocks<false>(out, in, 1, schedule->split_keys);
+  } else {
+    encrypt(out, in, schedule->sub_keys);
+  }
+}
+
+void Cipher::decrypt(uint8_t *out, const uint8_t *in,
+                     const key_schedule *schedule) {
+  if (engine_ == ENGINE_TABLE) {
+    table_des_blocks<true>(out, in, 1, schedule->split_keys);
+  } else {
+    decrypt(out, in, schedule->sub_keys);
+  }
+}
+
+void Cipher::encrypt_blocks(uint8_t *out, const uint8_t *in,
+                            size_t num_blocks, const key_schedule *schedule) {
+  if (engine_ == ENGINE_TABLE) {
+    table_des_blocks<false>(out, in, num_blocks, schedule->split_keys);
+    return;
+  }
+
+  size_t block;
+  for (block = 0; block < num_blocks; block++) {
+    encrypt(out + (block * BLOCK_SIZE), in + (block * BLOCK_SIZE),
+            schedule->sub_keys);
+  }
+}
+
+void Cipher::decrypt_blocks(uint8_t *out, const uint8_t *in,
+                            size_t num_blocks, const key_schedule *schedule) {
+  if (engine_ == ENGINE_TABLE) {
+    table_des_blocks<true>(out, in, num_blocks, schedule->split_keys);
+    return;
+  }
+
+  size_t block;
+  for (block = 0; block < num_blocks; block++) {
+    decrypt(out + (block * BLOCK_SIZE), in + (block * BLOCK_SIZE),
+            schedule->sub_keys);
+  }
+}
+
+TripleCipher::TripleCipher() { memset(split_keys_, 0, sizeof(split_keys_)); }
+
+TripleCipher::TripleCipher(const key_schedule *K1, const key_schedule *K2,
+                           const key_schedule *K3)
+    : TripleCipher() {
+  set_keys(K1, K2, K3);
+}
+
+void TripleCipher::set_keys(const key_schedule *K1, const key_schedule *K2,
+                            const key_schedule *K3) {
+  memcpy(split_keys_[0], K1->split_keys, sizeof(split_keys_[0]));
+  memcpy(split_keys_[1], K2->split_keys, sizeof(split_keys_[1]));
+  memcpy(split_keys_[2], K3->split_keys, sizeof(split_keys_[2]));
+}
+
+/* E(K1), D(K2), E(K3) */
+void TripleCipher::encrypt(uint8_t *out, const uint8_t *in) const {
+  table_ede3<1, false>(out, in, split_keys_);
+}
+
+/* D(K3), E(K2), D(K1) */
+void TripleCipher::decrypt(uint8_t *out, const uint8_t *in) const {
+  table_ede3<1, true>(out, in, split_keys_);
+}
+
+void TripleCipher::encrypt_blocks(uint8_t *out, const uint8_t *in,
+                                  size_t num_blocks) const {
+  table_ede3_blocks<false>(out, in, num_blocks, split_keys_);
+}
+
+void TripleCipher::decrypt_blocks(uint8_t *out, const uint8_t *in,
+                                  size_t num_blocks) const {
+  table_ede3_blocks<true>(out, in, num_blocks, split_keys_);
+}
 
 void Cipher::encrypt(uint8_t *out, const uint8_t *in,
                      const uint8_t sub_keys[NUM_ROUNDS][SUBKEY_SIZE]) {
@@ -122,8 +310,7 @@ void Cipher::encrypt(uint8_t *out, const uint8_t *in,
     exclusive_or(BLOCK_SIZE / 2, left_block, fiestel_right_block, left_block);
 
     if (round != (NUM_ROUNDS - 1)) {
-      swapper(BLOCK_SIZE / 2, (uint8_t **)&left_block,
-              (uint8_t **)&right_block);
+      swapper(BLOCK_SIZE / 2, left_block, right_block);
     }
   }
 
@@ -149,8 +336,7 @@ void Cipher::decrypt(uint8_t *out, const uint8_t *in,
     exclusive_or(BLOCK_SIZE / 2, left_block, fiestel_right_block, left_block);
 
     if (round != 0) {
-      swapper(BLOCK_SIZE / 2, (uint8_t **)&left_block,
-              (uint8_t **)&right_block);
+      swapper(BLOCK_SIZE / 2, left_block, right_block);
     }
   }
 
@@ -159,11 +345,14 @@ void Cipher::decrypt(uint8_t *out, const uint8_t *in,
   permute(BLOCK_SIZE, BLOCK_SIZE, permuted_out, out, FP);
 }
 
-void Cipher::swapper(uint8_t bytes, uint8_t **left_block,
-                     uint8_t **right_block) {
-  uint8_t *temp = *left_block;
-  *left_block = *right_block;
-  *right_block = temp;
+void Cipher::swapper(uint8_t bytes, uint8_t *left_block,
+                     uint8_t *right_block) {
+  uint8_t byte, temp;
+  for (byte = 0; byte < bytes; byte++) {
+    temp = left_block[byte];
+    left_block[byte] = right_block[byte];
+    right_block[byte] = temp;
+  }
 }
 
 void Cipher::feistel_function(const uint8_t *in_block, const uint8_t *round_key,
@@ -183,8 +372,6 @@ void Cipher::feistel_function(const uint8_t *in_block, const uint8_t *round_key,
 }
 
 void Cipher::substitute(const uint8_t *in_block, uint8_t *out_block) {
-  const uint8_t *substitution_boxes[] = {S1, S2, S3, S4, S5, S6, S7, S8};
-
   std::bitset<EXPANSION_SIZE * 8> bits;
   bytes_to_bitset48(in_block, &bits);
 
@@ -198,9 +385,9 @@ void Cipher::substitute(const uint8_t *in_block, uint8_t *out_block) {
      * On the second subsitution, put the 4-bit num on the right. */
     if (i % 2 == 0) {
       out_block[j] = 0;
-      out_block[j] |= (((substitution_boxes[i][(row * 16) + column])) << 4);
+      out_block[j] |= (((SBOXES[i][(row * 16) + column])) << 4);
     } else {
-      out_block[j] |= ((substitution_boxes[i][(row * 16) + column]));
+      out_block[j] |= ((SBOXES[i][(row * 16) + column]));
       j++;
     }
   }
@@ -224,6 +411,39 @@ void permute(const uint8_t in_bytes, const uint8_t out_bytes,
   }
 }
 
+bool permutation_tables_match() {
+  struct {
+    const Permutation *table;
+    const uint8_t *reference;
+    uint8_t bytes;
+  } checks[] = {{&ip_table, IP, BLOCK_SIZE},
+                {&fp_table, FP, BLOCK_SIZE},
+                {&p_table, P, BLOCK_SIZE / 2}};
+
+  /* Every single-bit input, then a run of pseudo-random blocks */
+  uint64_t x = 0x0123456789ABCDEF;
+  int i, c;
+  for (i = 0; i < 2 * 64; i++) {
+    uint64_t word = 1ULL << (i % 64);
+    if (i >= 64) {
+      x = x * 6364136223846793005ULL + 1442695040888963407ULL;
+      word = x;
+    }
+
+    for (c = 0; c < 3; c++) {
+      uint8_t in[BLOCK_SIZE], expected[BLOCK_SIZE], actual[BLOCK_SIZE];
+      uint8_t bytes = checks[c].bytes;
+      Permutation::store(word, in, bytes);
+      permute(bytes, bytes, in, expected, checks[c].reference);
+      Permutation::store(checks[c].table->apply(Permutation::load(in, bytes)),
+                         actual, bytes);
+      if (memcmp(expected, actual, bytes) != 0) return false;
+    }
+  }
+
+  return true;
+}
+
 void split(const uint8_t in_bytes, const uint8_t out_bytes,
            const uint8_t *in_block, uint8_t *left_block, uint8_t *right_block) {
   if ((in_bytes / out_bytes != 2) || (in_bytes % 2 != 0) ||
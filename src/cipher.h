@@ -18,8 +18,11 @@
 #ifndef CIPHER_H_
 #define CIPHER_H_
 
+#include <stddef.h>
 #include <stdint.h>
 
+#include "des_tables.h"
+
 #define NUM_ROUNDS 16
 #define NUM_SUB_BOXES 8
 #define BLOCK_SIZE 8          // in bytes
@@ -28,27 +31,94 @@
 #define SUBKEY_SIZE 6         // in bytes
 #define EXPANSION_SIZE 6      // in bytes
 
+/* Subkeys of a single key. sub_keys holds the 48-bit round keys as the  *
+ * KeyGenerator emits them. split_keys holds the same round keys split   *
+ * into the 6-bit groups consumed by each S-box: word 0 carries the      *
+ * groups of S1, S3, S5 and S7, word 1 those of S2, S4, S6 and S8, one   *
+ * group per byte. Built once per key by KeyGenerator::expand.           */
+typedef struct key_schedule {
+  uint8_t sub_keys[NUM_ROUNDS][SUBKEY_SIZE];
+  uint32_t split_keys[NUM_ROUNDS][2];
+} key_schedule;
+
 class Cipher {
  public:
+  /* REFERENCE follows the specification bit by bit. TABLE keeps both   *
+   * halves in 32-bit registers and evaluates S and P together through  *
+   * precomputed SP tables.                                             */
+  enum Engine { ENGINE_REFERENCE, ENGINE_TABLE };
+
   Cipher();
 
+  explicit Cipher(Engine engine);
+
+  Engine engine() const;
+
+  void set_engine(Engine engine);
+
+  void encrypt(uint8_t *out, const uint8_t *in, const key_schedule *schedule);
+
+  void decrypt(uint8_t *out, const uint8_t *in, const key_schedule *schedule);
+
+  /* Encrypt or decrypt num_blocks contiguous blocks. out may equal in  *
+   * for in-place operation but must not otherwise overlap it.          */
+  void encrypt_blocks(uint8_t *out, const uint8_t *in, size_t num_blocks,
+                      const key_schedule *schedule);
+
+  void decrypt_blocks(uint8_t *out, const uint8_t *in, size_t num_blocks,
+                      const key_schedule *schedule);
+
   void encrypt(uint8_t *out, const uint8_t *in, const uint8_t sub_keys[16][6]);
 
   void decrypt(uint8_t *out, const uint8_t *in, const uint8_t sub_keys[16][6]);
 
+  /* S-box stage of the reference engine: the 48 bits of in_block through *
+   * S1 to S8 into the 32 bits of out_block.                              */
+  void substitute(const uint8_t *in_block, uint8_t *out_block);
+
  private:
-  void swapper(uint8_t bytes, uint8_t **left_block, uint8_t **right_block);
+  Engine engine_;
+
+  void swapper(uint8_t bytes, uint8_t *left_block, uint8_t *right_block);
 
   void feistel_function(const uint8_t *in_block, const uint8_t *round_key,
                         uint8_t *out_block);
+};
 
-  void substitute(const uint8_t *in_block, uint8_t *out_block);
+/* Triple DES (EDE) on the table engine. Holds the split subkeys of K1, *
+ * K2 and K3 and runs all 48 rounds between a single IP and a single FP, *
+ * keeping both halves in registers throughout. in and out may alias.   */
+class TripleCipher {
+ public:
+  TripleCipher();
+
+  TripleCipher(const key_schedule *K1, const key_schedule *K2,
+               const key_schedule *K3);
+
+  void set_keys(const key_schedule *K1, const key_schedule *K2,
+                const key_schedule *K3);
+
+  void encrypt(uint8_t *out, const uint8_t *in) const;
+
+  void decrypt(uint8_t *out, const uint8_t *in) const;
+
+  /* Same contract as Cipher::encrypt_blocks */
+  void encrypt_blocks(uint8_t *out, const uint8_t *in, size_t num_blocks) const;
+
+  void decrypt_blocks(uint8_t *out, const uint8_t *in, size_t num_blocks) const;
+
+ private:
+  uint32_t split_keys_[3][NUM_ROUNDS][2];
 };
 
 void permute(const uint8_t in_bytes, const uint8_t out_bytes,
              const uint8_t *in_block, uint8_t *out_block,
              const uint8_t *permute_table);
 
+/* Whether the precomputed IP, FP and P tables agree with permute() on *
+ * the reference tables                                                */
+bool permutation_tables_match();
+
 void split(const uint8_t in_bytes, const uint8_t out_bytes,
            const uint8_t *in_block, uint8_t *left_block, uint8_t *right_block);
 
@@ -0,0 +1,146 @@
+/*
+ *  Copyright (C) 2019 Zachary Mohling
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "cpu_limits.h"
+
+#if defined(__linux__)
+#include <pthread.h>
+#include <sched.h>
+#endif
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <thread>
+#include <vector>
+
+/* Highest CPU number a list may name, plus one */
+#if defined(__linux__)
+#define MAX_CPUS CPU_SETSIZE
+#else
+#define MAX_CPUS 1024
+#endif
+
+/* CPUs granted by a CFS quota of quota microseconds per period, or 0 if *
+ * there is no quota.                                                    */
+static unsigned quota_cpus(long long quota, long long period) {
+  if (quota <= 0 || period <= 0) return 0;
+  return (unsigned)((quota + period - 1) / period);
+}
+
+/* Quota from cgroup v2, "max 100000" or "<quota> <period>" */
+static unsigned cgroup_v2_cpus() {
+  FILE *file = fopen("/sys/fs/cgroup/cpu.max", "r");
+  if (!file) return 0;
+
+  char quota[32];
+  long long period = 0;
+  unsigned cpus = 0;
+  if (fscanf(file, "%31s %lld", quota, &period) == 2 &&
+      strcmp(quota, "max") != 0) {
+    cpus = quota_cpus(atoll(quota), period);
+  }
+
+  fclose(file);
+  return cpus;
+}
+
+/* Quota from cgroup v1, -1 when unlimited */
+static unsigned cgroup_v1_cpus() {
+  FILE *quota_file = fopen("/sys/fs/cgroup/cpu/cpu.cfs_quota_us", "r");
+  FILE *period_file = fopen("/sys/fs/cgroup/cpu/cpu.cfs_period_us", "r");
+
+  long long quota = 0, period = 0;
+  if (!quota_file || !period_file || fscanf(quota_file, "%lld", &quota) != 1 ||
+      fscanf(period_file, "%lld", &period) != 1) {
+    quota = 0;
+  }
+
+  if (quota_file) fclose(quota_file);
+  if (period_file) fclose(period_file);
+
+  return quota_cpus(quota, period);
+}
+
+unsigned available_cpus() {
+  unsigned cpus = std::thread::hardware_concurrency();
+
+#if defined(__linux__)
+  cpu_set_t set;
+  if (sched_getaffinity(0, sizeof(set), &set) == 0) cpus = CPU_COUNT(&set);
+
+  unsigned quota = cgroup_v2_cpus();
+  if (quota == 0) quota = cgroup_v1_cpus();
+  if (quota > 0 && (cpus == 0 || quota < cpus)) cpus = quota;
+#endif
+
+  return cpus > 0 ? cpus : 1;
+}
+
+bool parse_cpu_list(const char *list, std::vector<unsigned> *cpus) {
+  cpus->clear();
+
+#if defined(__linux__)
+  cpu_set_t allowed;
+  if (sched_getaffinity(0, sizeof(allowed), &allowed) != 0) return false;
+#endif
+
+  const char *at = list;
+  while (*at) {
+    char *end;
+    errno = 0;
+    unsigned long first = strtoul(at, &end, 10), last = first;
+    if (errno != 0 || end == at) return false;
+
+    if (*end == '-') {
+      at = end + 1;
+      last = strtoul(at, &end, 10);
+      if (errno != 0 || end == at || last < first) return false;
+    }
+
+    if (*end == ',' && end[1] != '\0')
+      end++;
+    else if (*end != '\0')
+      return false;
+
+    if (last >= MAX_CPUS) return false;
+
+    unsigned long cpu;
+    for (cpu = first; cpu <= last; cpu++) {
+#if defined(__linux__)
+      if (!CPU_ISSET(cpu, &allowed)) return false;
+#endif
+      cpus->push_back((unsigned)cpu);
+    }
+
+    at = end;
+  }
+
+  return !cpus->empty();
+}
+
+void pin_thread(const unsigned *cpus, unsigned num_cpus, unsigned index) {
+  if (num_cpus == 0) return;
+
+#if defined(__linux__)
+  cpu_set_t set;
+  CPU_ZERO(&set);
+  CPU_SET(cpus[index % num_cpus], &set);
+  pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+#endif
+}
@@ -0,0 +1,37 @@
+/*
+ *  Copyright (C) 2019 Zachary Mohling
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef CPU_LIMITS_H_
+#define CPU_LIMITS_H_
+
+#include <vector>
+
+/* Number of CPUs this process may actually use: the smaller of the CPUs *
+ * in its affinity mask and its cgroup CPU quota (cgroup v2 cpu.max or    *
+ * v1 cpu.cfs_quota_us), rounded up. At least 1.                          */
+unsigned available_cpus();
+
+/* Parse a list of CPUs such as "0-7,16-23" into cpus, in order. Returns *
+ * false unless it is one, naming only CPUs this process may run on.     */
+bool parse_cpu_list(const char *list, std::vector<unsigned> *cpus);
+
+/* Pin the calling thread to CPU index of the num_cpus in cpus, wrapping *
+ * around. Does nothing if num_cpus is 0, or where threads cannot be     *
+ * pinned.                                                               */
+void pin_thread(const unsigned *cpus, unsigned num_cpus, unsigned index);
+
+#endif  // CPU_LIMITS_H_
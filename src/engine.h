@@ -0,0 +1,75 @@
+/*
+ *  Copyright (C) 2019 Zachary Mohling
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef ENGINE_H_
+#define ENGINE_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "bitslice.h"
+#include "cipher.h"
+
+/* K1, K2 and K3 in the form each engine consumes. bitslice is only  *
+ * filled in, and bitsliced set, when the keys are loaded for a        *
+ * bitsliced engine.                                                   */
+typedef struct engine_keys {
+  key_schedule schedules[3];
+  TripleCipher table;
+  bitslice_keys bitslice;
+  bool bitsliced;
+} engine_keys;
+
+/* One Triple DES (EDE) implementation. crypt encrypts or decrypts      *
+ * num_blocks blocks from in to out, which may be the same buffer.      *
+ * Runs shorter than min_blocks are better left to the table engine,    *
+ * which has no batch to fill. bitsliced engines read the bitslice      *
+ * masks of their keys. supported probes the host's CPUID for the       *
+ * instruction set the engine was compiled for.                         */
+typedef struct tdes_engine {
+  const char *name;
+  const char *description;
+  unsigned min_blocks;
+  bool bitsliced;
+  bool (*supported)();
+  void (*crypt)(uint8_t *out, const uint8_t *in, size_t num_blocks,
+                const engine_keys *keys, bool decrypting);
+} tdes_engine;
+
+/* Every engine built into the binary, fastest first, whether or not   *
+ * the host supports it. Stores the count in num_engines.              */
+const tdes_engine *engine_list(size_t *num_engines);
+
+/* Engine called name, or NULL if there is none */
+const tdes_engine *engine_find(const char *name);
+
+/* Fastest engine the host supports */
+const tdes_engine *engine_default();
+
+/* Load K1, K2 and K3 for engine, or for every engine if it is NULL.  *
+ * The table engine's keys are always loaded, for short runs.          */
+void engine_load_keys(const key_schedule *K1, const key_schedule *K2,
+                      const key_schedule *K3, const tdes_engine *engine,
+                      engine_keys *keys);
+
+/* Expand num_sets key sets of 24 bytes each, K1, K2 and K3 back to   *
+ * back, into keys[0 .. num_sets - 1], ready for engine as above. For  *
+ * workloads that rekey per file, record or tenant.                    */
+void engine_expand_keys(const uint8_t *key_sets, size_t num_sets,
+                        const tdes_engine *engine, engine_keys *keys);
+
+#endif  // ENGINE_H_
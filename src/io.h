@@ -39,14 +39,31 @@
 
 #define VERSION_NO "1.0.1"
 
+/* Where the password is read from and where notices and progress go.   *
+ * Normally the terminal on stdin and stdout; when either carries data, *
+ * see use_terminal(). password_on_tty is set when the password must    *
+ * come from the controlling terminal, which is only opened once it is  *
+ * asked for.                                                           */
+static FILE *tty_in = stdin;
+static bool password_on_tty = false;
+static std::ostream *ui = &std::cout;
+
 int file_exists(const char *filename) {
   struct stat st;
   int result = stat(filename, &st);
   return result == 0;
 }
 
+/* Open path, or stdin or stdout for "-". The length of a stream is not *
+ * known and is left at 0.                                              */
 void open_file(FILE **file, std::string path, const char *mode,
                uint64_t *total_length) {
+  if (path == "-") {
+    *file = (strcmp(mode, "rb") == 0) ? stdin : stdout;
+    if (total_length) *total_length = 0;
+    return;
+  }
+
   if (!(*file = fopen(path.c_str(), mode))) {
     fprintf(stderr, "Could not open file %s. ERROR: %d\n", path.c_str(), errno);
     exit(-1);
@@ -59,28 +76,54 @@ void open_file(FILE **file, std::string path, const char *mode,
   }
 }
 
+/* Keep the prompts and progress off the data streams: read the password *
+ * from the controlling terminal when stdin carries data, and print to   *
+ * stderr when stdout does. The terminal is not opened here, so that a   *
+ * run whose keys come from tdes-agent needs none.                       */
+void use_terminal(bool data_on_stdin, bool data_on_stdout) {
+  if (data_on_stdout) ui = &std::cerr;
+
+  password_on_tty = data_on_stdin;
+}
+
+/* Open the controlling terminal for the password, if stdin carries data */
+static void open_password_input() {
+  if (!password_on_tty || tty_in != stdin) return;
+
+  if (!(tty_in = fopen("/dev/tty", "r"))) {
+    fprintf(stderr, "Could not open terminal for password. ERROR: %d\n",
+            errno);
+    exit(-1);
+  }
+}
+
+/* Whether notices and progress reach a terminal, or a file or pipe */
+bool ui_is_terminal() {
+  return isatty(ui == &std::cerr ? STDERR_FILENO : STDOUT_FILENO);
+}
+
 static void toggle_visible_input() {
   static struct termios oldt, newt;
   static bool stalled = false;
 
   if (stalled) {
     /*resetting our old STDIN_FILENO*/
-    tcsetattr(STDIN_FILENO, TCSANOW, &oldt);
+    tcsetattr(fileno(tty_in), TCSANOW, &oldt);
 
     stalled = !stalled;
   } else {
     /* saving the old settings */
-    tcgetattr(STDIN_FILENO, &oldt);
+    tcgetattr(fileno(tty_in), &oldt);
     newt = oldt;
     newt.c_lflag &= ~(ECHO);
-    tcsetattr(STDIN_FILENO, TCSANOW, &newt);
+    tcsetattr(fileno(tty_in), TCSANOW, &newt);
 
     stalled = !stalled;
   }
 }
 
 void startup_notice() {
-  std::cout
+  *ui
       << "tdes " << VERSION_NO
       << "  Copyright (C) 2019 Zachary Mohling. This program "
          "comes with \nABSOLUTELY NO WARRANTY. This "
@@ -93,85 +136,44 @@ void prompt_password(std::string *out_password, int mode) {
   int c, password_size = 32, i = 0;
   std::string password, confirmed_password;
 
+  open_password_input();
   toggle_visible_input();
 
   if (mode == 0) {
-    std::cout << "*** Caution: Reuse of a key will eventuate to a rollover ***"
+    *ui << "*** Caution: Reuse of a key will eventuate to a rollover ***"
               << std::endl;
   } else {
-    std::cout << "*** Warning: Decrypting with the incorrect key will corrupt "
+    *ui << "*** Warning: Decrypting with the incorrect key will corrupt "
                  "the output file ***"
               << std::endl;
   }
 
   /* Prompt user for password and parse/store it */
-  std::cout << "Enter a password: ";
-  for (i = 0; (c = getchar()) != '\n' && c != EOF && i < password_size; i++) {
+  *ui << "Enter a password: ";
+  for (i = 0; (c = getc(tty_in)) != '\n' && c != EOF && i < password_size;
+       i++) {
     password.push_back((char)c);
   }
   password.push_back((char)'\0');
 
   /* Prompt user to confirm password and parse/store it */
-  std::cout << std::endl << "Confirm password: ";
-  for (i = 0; (c = getchar()) != '\n' && c != EOF && i < password_size; i++) {
+  *ui << std::endl << "Confirm password: ";
+  for (i = 0; (c = getc(tty_in)) != '\n' && c != EOF && i < password_size;
+       i++) {
     confirmed_password.push_back((char)c);
   }
   confirmed_password.push_back((char)'\0');
 
-  std::cout << std::endl;
+  *ui << std::endl;
   toggle_visible_input();
 
   /* Confirm that passwords match */
   if (password.compare(confirmed_password) == 0) {
     *out_password = password;
   } else {
-    std::cout << std::endl << "Aborting. Passwords do not match." << std::endl;
+    *ui << std::endl << "Aborting. Passwords do not match." << std::endl;
     exit(-1);
   }
 }
 
-void print_progress(int _progress, int mode) {
-  static int progress = -1, init = 0;
-
-  /* Prevent printing if percentage hasn't changed */
-  if (_progress <= progress)
-    return;
-  else {
-    progress = _progress;
-    std::cout << "\r";
-    std::cout.flush();
-  }
-
-  /* Toggle user input */
-  if (init == 0) {
-    toggle_visible_input();
-    init = 1;
-  }
-
-  if (mode == 0)
-    std::cout << "Encrypting - [";
-  else
-    std::cout << "Decrypting - [";
-
-  int barWidth = 60;
-  int pos = barWidth * (progress / 100.0);
-
-  for (int i = 0; i < barWidth; ++i) {
-    if (i < pos)
-      std::cout << "=";
-    else if (i == pos)
-      std::cout << ">";
-    else
-      std::cout << " ";
-  }
-
-  std::cout << "] " << progress << "%\r";
-  std::cout.flush();
-
-  if (progress == 100) {
-    std::cout << std::endl;
-    toggle_visible_input();
-  }
-}
-
 #endif  // IO_H_
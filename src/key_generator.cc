@@ -17,98 +17,93 @@
 
 #include "key_generator.h"
 
-#include <assert.h>
-#include <limits.h>
 #include <stdint.h>
 #include <stdlib.h>
-#include <string.h>
-#include <bitset>
 #include <iostream>
 
 #include "cipher.h"
+#include "permutation.h"
 
-/* Prototypes */
-static void bytes_to_bitset56(const uint8_t *bytes, std::bitset<56> *b);
-
-/* Permuted Choice 1 - Key Schedule */
-const uint8_t PC1[] = {57, 49, 41, 33, 25, 17, 9,  1,  58, 50, 42, 34, 26, 18,
-                       10, 2,  59, 51, 43, 35, 27, 19, 11, 3,  60, 52, 44, 36,
-                       63, 55, 47, 39, 31, 23, 15, 7,  62, 54, 46, 38, 30, 22,
-                       14, 6,  61, 53, 45, 37, 29, 21, 13, 5,  28, 20, 12, 4};
-
-/* Permuted Choice 2 - Key Schedule */
-const uint8_t PC2[] = {14, 17, 11, 24, 1,  5,  3,  28, 15, 6,  21, 10,
-                       23, 19, 12, 4,  26, 8,  16, 7,  27, 20, 13, 2,
-                       41, 52, 31, 37, 47, 55, 30, 40, 51, 45, 33, 48,
-                       44, 49, 39, 56, 34, 53, 46, 42, 50, 36, 29, 32};
-
-/* Bit rotation - Key */
-const uint8_t bit_rotation[] = {1, 1, 2, 2, 2, 2, 2, 2, 1, 2, 2, 2, 2, 2, 2, 1};
+/* Byte-indexed tables of PC1 and PC2 */
+static constexpr Permutation pc1_table(8, 7, PC1);
+static constexpr Permutation pc2_table(7, 6, PC2);
 
 KeyGenerator::KeyGenerator() {}
 
+/* Rotate a 28-bit key half left */
+static inline uint64_t rotate_half(uint64_t half, unsigned shift) {
+  return ((half << shift) | (half >> (28 - shift))) & 0xFFFFFFF;
+}
+
+/* PC1 and PC2 go through their byte-indexed tables, with the two 28-bit *
+ * halves held as integers in between.                                   */
 void KeyGenerator::generate(const uint8_t *key_with_parities,
                             uint8_t round_keys[16][6]) {
-  uint8_t T1[7], T2[7];
-  uint64_t left_key = 0, right_key = 0;
-
-  /* init */
-  memset(round_keys, 0, 16 * 6);
-  memset(T1, 0, 7);
-
-  permute(8, 7, (const uint8_t *)key_with_parities, T1, PC1);
-
-  split_keys(T1, &left_key, &right_key);
+  uint64_t permuted = pc1_table.apply(Permutation::load(key_with_parities, 8));
+  uint64_t left_key = permuted >> 28, right_key = permuted & 0xFFFFFFF;
 
   int i;
   for (i = 0; i < 16; i++) {
-    shift_left(&left_key, bit_rotation[i]);
-
-    shift_left(&right_key, bit_rotation[i]);
+    left_key = rotate_half(left_key, bit_rotation[i]);
 
-    combine_keys(&left_key, &right_key, T2);
+    right_key = rotate_half(right_key, bit_rotation[i]);
 
-    permute(7, 6, T2, round_keys[i], PC2);
+    Permutation::store(pc2_table.apply((left_key << 28) | right_key),
+                       round_keys[i], 6);
   }
 }
 
-void KeyGenerator::shift_left(uint64_t *key, const uint8_t num_shifts) {
-  assert(num_shifts < 28);
-  *key = (*key << num_shifts) | (*key >> (-num_shifts & 27));
-}
-
-void KeyGenerator::split_keys(const uint8_t *key, uint64_t *left_key,
-                              uint64_t *right_key) {
-  std::bitset<56> parity_dropped_key;
+/* Schedules of N keys side by side. The halves stay packed 28 bits to *
+ * an integer, every round key comes out of the PC2 table in one       *
+ * lookup per byte, and its split groups are cut out of it in          *
+ * registers.                                                          */
+template <int N>
+static inline void expand_keys(const uint8_t *keys, key_schedule *schedules) {
+  uint64_t left[N], right[N];
 
-  bytes_to_bitset56((const uint8_t *)key, &parity_dropped_key);
-
-  *left_key = (parity_dropped_key.to_ullong() >> 28) & 0xFFFFFFF;
+  int i;
+  for (i = 0; i < N; i++) {
+    uint64_t permuted =
+        pc1_table.apply(Permutation::load(keys + (i * KEY_SIZE), KEY_SIZE));
+    left[i] = permuted >> 28;
+    right[i] = permuted & 0xFFFFFFF;
+  }
 
-  *right_key = parity_dropped_key.to_ullong() & 0xFFFFFFF;
+  int round;
+  for (round = 0; round < NUM_ROUNDS; round++) {
+    for (i = 0; i < N; i++) {
+      left[i] = rotate_half(left[i], bit_rotation[round]);
+      right[i] = rotate_half(right[i], bit_rotation[round]);
+
+      uint64_t combined = (left[i] << 28) | right[i];
+      key_schedule *schedule = &schedules[i];
+
+      uint64_t sub_key = pc2_table.apply(combined);
+      Permutation::store(sub_key, schedule->sub_keys[round], SUBKEY_SIZE);
+
+      /* Groups 1, 3, 5 and 7 of the round key, then 2, 4, 6 and 8 */
+      schedule->split_keys[round][0] =
+          ((sub_key >> 18) & 0x3F000000) | ((sub_key >> 14) & 0x3F0000) |
+          ((sub_key >> 10) & 0x3F00) | ((sub_key >> 6) & 0x3F);
+      schedule->split_keys[round][1] =
+          ((sub_key >> 12) & 0x3F000000) | ((sub_key >> 8) & 0x3F0000) |
+          ((sub_key >> 4) & 0x3F00) | (sub_key & 0x3F);
+    }
+  }
 }
 
-void KeyGenerator::combine_keys(const uint64_t *left_key,
-                                const uint64_t *right_key,
-                                uint8_t *combined_key) {
-  memset(combined_key, 0, 7);
-
-  uint64_t combined_int64 = *left_key << 28 | (*right_key & 0xFFFFFFF);
-
-  int byte;
-  for (byte = 6; byte >= 0; byte--)
-    combined_key[byte] |= combined_int64 >> ((6 - byte) * 8);
+void KeyGenerator::expand(const uint8_t *key_with_parities,
+                          key_schedule *schedule) {
+  expand_keys<1>(key_with_parities, schedule);
 }
 
-static void bytes_to_bitset56(const uint8_t *bytes, std::bitset<56> *b) {
-  for (int i = 0; i < 7; ++i) {
-    uint8_t cur = bytes[6 - i];
-    int offset = i * CHAR_BIT;
-
-    for (int bit = 0; bit < CHAR_BIT; ++bit) {
-      (*b)[offset] = cur & 1;
-      ++offset;
-      cur >>= 1;
-    }
+void KeyGenerator::expand_batch(const uint8_t *keys, size_t num_keys,
+                                key_schedule *schedules) {
+  for (; num_keys >= 2; num_keys -= 2) {
+    expand_keys<2>(keys, schedules);
+    keys += 2 * KEY_SIZE;
+    schedules += 2;
   }
+
+  if (num_keys > 0) expand_keys<1>(keys, schedules);
 }
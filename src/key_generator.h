@@ -18,6 +18,7 @@
 #ifndef KEY_GENERATOR_H_
 #define KEY_GENERATOR_H_
 
+#include <stddef.h>
 #include <stdint.h>
 
 #include "cipher.h"
@@ -28,13 +29,15 @@ class KeyGenerator {
 
   void generate(const uint8_t *key_with_parities, uint8_t round_keys[16][6]);
 
-  void shift_left(uint64_t *key, const uint8_t num_shifts);
+  /* Expand an 8-byte key straight into the schedule the engines read:   *
+   * both the round keys and their split S-box groups.                   */
+  static void expand(const uint8_t *key_with_parities, key_schedule *schedule);
 
-  void split_keys(const uint8_t *in_block, uint64_t *left_block,
-                  uint64_t *right_block);
-
-  void combine_keys(const uint64_t *left_block, const uint64_t *right_block,
-                    uint8_t *out_block);
+  /* Expand num_keys keys stored back to back, 8 bytes each, into        *
+   * schedules[0 .. num_keys - 1]. Two keys run side by side so the      *
+   * table lookups of one hide the latency of the other.                 */
+  static void expand_batch(const uint8_t *keys, size_t num_keys,
+                           key_schedule *schedules);
 
  private:
 };
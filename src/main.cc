@@ -16,50 +16,196 @@
  */
 
 #include <assert.h>
+#include <errno.h>
 #include <limits.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/stat.h>
 #include <algorithm>
 #include <bitset>
 #include <ctime>
 #include <iostream>
 #include <vector>
 
+#include "cpu_limits.h"
+#include "engine.h"
+#include "modes.h"
 #include "tdes.h"
 
-static bool does_option_exist(char **begin, char **end,
-                              const std::string &option) {
-  return std::find(begin, end, option) != end;
+#define USAGE                                                            \
+  "Incorrect usage: tdes [-enc|-dec] [options] <source|-> <dest|->\n"    \
+  "             or: tdes [-enc|-dec] [options] <source>... <dest-dir>\n" \
+  "  --block-mode M      ecb, ctr or cbc, ecb by default\n"              \
+  "  --mmap              map regular files instead of streaming\n"       \
+  "  --chunk-size N[K|M] bytes per chunk of the circular buffer\n"       \
+  "  --ring-depth N      chunks in the circular buffer\n"                \
+  "  --workers N         threads in the worker pool\n"                   \
+  "  --autotune          calibrate the above for this machine\n"         \
+  "  --engine NAME       cipher engine, the fastest the CPU supports\n"  \
+  "  --list-engines      list the engines and exit\n"                    \
+  "  --stats             print per-stage counters when done\n"           \
+  "  --stats-json        the same as one JSON object\n"                  \
+  "  --pin CPUS          pin threads to CPUs, e.g. 0-7,16-23\n"
+
+/* Parse a count with an optional K, M or G suffix. Exits on anything *
+ * that is not a whole number within [min, max].                      */
+static uint64_t parse_size(const char *option, const char *value,
+                           uint64_t min, uint64_t max) {
+  char *end;
+  errno = 0;
+  uint64_t size = strtoull(value, &end, 10);
+
+  if (*end == 'K' || *end == 'k') {
+    size *= 1024, end++;
+  } else if (*end == 'M' || *end == 'm') {
+    size *= 1024 * 1024, end++;
+  } else if (*end == 'G' || *end == 'g') {
+    size *= 1024 * 1024 * 1024, end++;
+  }
+
+  if (errno != 0 || end == value || *end != '\0' || size < min || size > max) {
+    fprintf(stderr, "Invalid value for %s: %s\n", option, value);
+    exit(-2);
+  }
+
+  return size;
+}
+
+/* Print every engine, marking the default and those the host lacks */
+static void list_engines() {
+  size_t num_engines, i;
+  const tdes_engine *engines = engine_list(&num_engines);
+  const tdes_engine *chosen = engine_default();
+
+  for (i = 0; i < num_engines; i++) {
+    printf("%c %-16s %s%s\n", &engines[i] == chosen ? '*' : ' ',
+           engines[i].name, engines[i].description,
+           engines[i].supported() ? "" : " (not supported by this CPU)");
+  }
+  printf("* default on this host\n");
 }
 
 int main(int argc, char *argv[]) {
-  if (argc != 4) {
-    fprintf(stderr, "Incorrect usage: tdes [-enc|-dec] <source> <dest>\n");
+  int mode = -1;  // 0 for encrypt, 1 for decrypt
+  tdes_options options = {};
+  std::vector<std::string> file_names;
+  std::vector<unsigned> pin_cpus;
+
+  int i;
+  for (i = 1; i < argc; i++) {
+    std::string arg(argv[i]);
+    bool has_value = (i + 1 < argc);
+
+    if (arg == "-enc" || arg == "--encrypt") {
+      mode = 0;
+    } else if (arg == "-dec" || arg == "--decrypt") {
+      mode = 1;
+    } else if (arg == "-mmap" || arg == "--mmap") {
+      /* Map the files into memory instead of streaming them through the *
+       * circular buffer                                                  */
+      options.map_files = true;
+    } else if (arg == "--block-mode" && has_value) {
+      std::string value(argv[++i]);
+      if (value == "ecb") {
+        options.block_mode = BLOCK_MODE_ECB;
+      } else if (value == "ctr") {
+        options.block_mode = BLOCK_MODE_CTR;
+      } else if (value == "cbc") {
+        options.block_mode = BLOCK_MODE_CBC;
+      } else {
+        fprintf(stderr, "Invalid value for --block-mode: %s\n", value.c_str());
+        return -2;
+      }
+    } else if (arg == "--autotune") {
+      options.autotune = true;
+    } else if (arg == "--chunk-size" && has_value) {
+      options.chunk_size =
+          parse_size(argv[i], argv[i + 1], BLOCK_SIZE, MAX_CHUNK_SIZE);
+      if (options.chunk_size % BLOCK_SIZE != 0) {
+        fprintf(stderr, "--chunk-size must be a multiple of %d\n",
+                BLOCK_SIZE);
+        return -2;
+      }
+      i++;
+    } else if (arg == "--ring-depth" && has_value) {
+      options.ring_depth =
+          parse_size(argv[i], argv[i + 1], MIN_RING_DEPTH, UINT16_MAX);
+      i++;
+    } else if (arg == "--workers" && has_value) {
+      options.num_workers = parse_size(argv[i], argv[i + 1], 1, 1024);
+      i++;
+    } else if (arg == "--engine" && has_value) {
+      options.engine = engine_find(argv[++i]);
+      if (!options.engine) {
+        fprintf(stderr, "Invalid value for --engine: %s\n", argv[i]);
+        return -2;
+      }
+      if (!options.engine->supported()) {
+        fprintf(stderr, "Engine %s is not supported by this CPU\n", argv[i]);
+        return -2;
+      }
+    } else if (arg == "--pin" && has_value) {
+      if (!parse_cpu_list(argv[++i], &pin_cpus)) {
+        fprintf(stderr, "Invalid value for --pin: %s\n", argv[i]);
+        return -2;
+      }
+      options.pin_cpus = pin_cpus.data();
+      options.num_pin_cpus = pin_cpus.size();
+    } else if (arg == "--stats") {
+      options.stats = STATS_TEXT;
+    } else if (arg == "--stats-json") {
+      options.stats = STATS_JSON;
+    } else if (arg == "--list-engines") {
+      list_engines();
+      return 0;
+    } else if (arg[0] == '-' && arg != "-") {
+      fprintf(stderr, USAGE);
+      return -2;
+    } else {
+      file_names.push_back(arg);
+    }
+  }
+
+  if (file_names.size() < 2) {
+    fprintf(stderr, USAGE);
     return -1;
   }
 
-  int mode = 0;  // 0 for encrypt, 1 for decrypt
-  std::string in_file_name(argv[2]), out_file_name(argv[3]);
-
-  if (does_option_exist(argv, argv + argc, "-enc") ||
-      does_option_exist(argv, argv + argc, "--encrypt")) {
-    mode = 0;
-  } else if (does_option_exist(argv, argv + argc, "-dec") ||
-             does_option_exist(argv, argv + argc, "--decrypt")) {
-    mode = 1;
-  } else {
-    fprintf(stderr, "Incorrect usage: tdes [-enc|-dec] <source> <dest>\n");
+  if (mode == -1) {
+    fprintf(stderr, USAGE);
     return -2;
   }
 
-  /* Check if output file is original file */
-  if (strcmp(in_file_name.c_str(), out_file_name.c_str()) == 0) {
+  /* Several sources, or a directory, make a batch into a directory */
+  struct stat source_stat;
+  bool source_is_dir = (stat(file_names[0].c_str(), &source_stat) == 0 &&
+                        S_ISDIR(source_stat.st_mode));
+  if (file_names.size() > 2 || source_is_dir) {
+    std::string out_dir(file_names.back());
+    file_names.pop_back();
+
+    if (std::find(file_names.begin(), file_names.end(), "-") !=
+            file_names.end() ||
+        out_dir == "-") {
+      fprintf(stderr, "Aborting. A batch cannot read or write a stream.\n");
+      return -2;
+    }
+
+    run_batch(mode, &file_names, &out_dir, &options);
+    return 0;
+  }
+
+  std::string in_file_name(file_names[0]), out_file_name(file_names[1]);
+
+  /* Check if output file is original file. "-" is stdin or stdout. */
+  if (in_file_name != "-" &&
+      strcmp(in_file_name.c_str(), out_file_name.c_str()) == 0) {
     fprintf(stderr, "Aborting. Refusing to overwrite original file: %s\n",
             in_file_name.c_str());
     exit(-1);
   }
 
-  run(mode, &in_file_name, &out_file_name);
+  run(mode, &in_file_name, &out_file_name, &options);
 }
@@ -0,0 +1,62 @@
+/*
+ *  Copyright (C) 2019 Zachary Mohling
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "modes.h"
+
+#include <stdint.h>
+#include <string.h>
+
+#include "cipher.h"
+
+/* 32 bytes per operation. The compiler lowers it to whatever vector *
+ * registers the baseline instruction set has.                       */
+typedef uint64_t xor_word_t __attribute__((vector_size(32)));
+
+void ctr_counters(uint8_t *blocks, uint64_t nonce, uint64_t first_block,
+                  size_t num_blocks) {
+  size_t block;
+  for (block = 0; block < num_blocks; block++) {
+    store_nonce(nonce + first_block + block, blocks + (block * BLOCK_SIZE));
+  }
+}
+
+void xor_bytes(uint8_t *out, const uint8_t *in, const uint8_t *keystream,
+               size_t num_bytes) {
+  size_t i = 0;
+  for (; i + sizeof(xor_word_t) <= num_bytes; i += sizeof(xor_word_t)) {
+    xor_word_t data, key;
+    memcpy(&data, in + i, sizeof(data));
+    memcpy(&key, keystream + i, sizeof(key));
+
+    data ^= key;
+    memcpy(out + i, &data, sizeof(data));
+  }
+
+  for (; i < num_bytes; i++) out[i] = in[i] ^ keystream[i];
+}
+
+uint64_t load_nonce(const uint8_t *bytes) {
+  uint64_t nonce = 0;
+  int i;
+  for (i = 0; i < BLOCK_SIZE; i++) nonce = (nonce << 8) | bytes[i];
+  return nonce;
+}
+
+void store_nonce(uint64_t nonce, uint8_t *bytes) {
+  int i;
+  for (i = BLOCK_SIZE - 1; i >= 0; i--, nonce >>= 8) bytes[i] = nonce;
+}
@@ -0,0 +1,62 @@
+/*
+ *  Copyright (C) 2019 Zachary Mohling
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef MODES_H_
+#define MODES_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* Block modes of operation. ECB runs every block through the cipher on  *
+ * its own and pads the input to PKCS#5. CTR encrypts a counter per block *
+ * and XORs the result into the data, so it needs no padding and both     *
+ * directions run through the encrypting cipher. CBC chains the blocks of *
+ * each CBC_SEGMENT_SIZE segment of the padded input, starting from an IV *
+ * of its own, so that segments can be encrypted side by side and every   *
+ * block decrypted in parallel.                                           */
+#define BLOCK_MODE_ECB 0
+#define BLOCK_MODE_CTR 1
+#define BLOCK_MODE_CBC 2
+
+/* CTR and CBC output starts with a random nonce: the counter of the first *
+ * block for CTR; for CBC, the IV of segment k is the encryption of nonce  *
+ * + k.                                                                    */
+#define NONCE_SIZE 8
+
+/* Blocks per CBC segment. Chunks and work items are whole segments. */
+#define CBC_SEGMENT_BLOCKS 512
+#define CBC_SEGMENT_SIZE (CBC_SEGMENT_BLOCKS * 8)
+
+/* Most CBC segments encrypted side by side, one block of each per call */
+#define CBC_MAX_STREAMS 64
+
+/* Blocks of keystream generated per batch on the stack */
+#define CTR_BATCH_BLOCKS 512
+
+/* Write the counter blocks nonce + first_block .. nonce + first_block +  *
+ * num_blocks - 1, as 64-bit big-endian integers, to blocks.              */
+void ctr_counters(uint8_t *blocks, uint64_t nonce, uint64_t first_block,
+                  size_t num_blocks);
+
+/* out = in ^ keystream over num_bytes bytes. out may equal in. */
+void xor_bytes(uint8_t *out, const uint8_t *in, const uint8_t *keystream,
+               size_t num_bytes);
+
+uint64_t load_nonce(const uint8_t *bytes);
+void store_nonce(uint64_t nonce, uint8_t *bytes);
+
+#endif  // MODES_H_
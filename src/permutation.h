@@ -0,0 +1,85 @@
+/*
+ *  Copyright (C) 2019 Zachary Mohling
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef PERMUTATION_H_
+#define PERMUTATION_H_
+
+#include <stdint.h>
+
+/* Precomputed form of a permutation table (IP, FP, P, PC1, PC2). For     *
+ * every input byte and every value of that byte it holds the output bits *
+ * the byte contributes, so applying a permutation costs one lookup and   *
+ * one OR per input byte. Blocks are handled as big-endian integers,      *
+ * right-aligned in a 64-bit word. The constructor is constexpr, so the   *
+ * file-level tables are generated by the compiler and need no            *
+ * initialization at startup. The reference permute() stays the           *
+ * definition they are checked against; tdes-bench runs                   *
+ * permutation_tables_match() before any suite.                          */
+class Permutation {
+ public:
+  constexpr Permutation(uint8_t in_bytes, uint8_t out_bytes,
+                        const uint8_t *permute_table);
+
+  constexpr uint64_t apply(uint64_t in) const;
+
+  static uint64_t load(const uint8_t *block, uint8_t bytes);
+
+  static void store(uint64_t word, uint8_t *block, uint8_t bytes);
+
+ private:
+  /* table_[k][v]: output bits for value v of the k-th least significant *
+   * input byte. Rows past the input's bytes stay zero.                  */
+  uint64_t table_[8][256];
+};
+
+/* Output bit j copies input bit permute_table[j], so it is set in every *
+ * entry of the row holding that input bit whose value has the bit set.  */
+constexpr Permutation::Permutation(uint8_t in_bytes, uint8_t out_bytes,
+                                   const uint8_t *permute_table)
+    : table_() {
+  for (int bit = 0; bit < out_bytes * 8; bit++) {
+    int source = permute_table[bit] - 1;
+    int row = (in_bytes - 1) - (source / 8);
+    unsigned mask = 0x80 >> (source % 8);
+    uint64_t out_bit = (uint64_t)1 << ((out_bytes * 8) - 1 - bit);
+
+    for (unsigned value = 0; value < 256; value++) {
+      if (value & mask) table_[row][value] |= out_bit;
+    }
+  }
+}
+
+constexpr uint64_t Permutation::apply(uint64_t in) const {
+  return table_[0][in & 0xFF] | table_[1][(in >> 8) & 0xFF] |
+         table_[2][(in >> 16) & 0xFF] | table_[3][(in >> 24) & 0xFF] |
+         table_[4][(in >> 32) & 0xFF] | table_[5][(in >> 40) & 0xFF] |
+         table_[6][(in >> 48) & 0xFF] | table_[7][in >> 56];
+}
+
+inline uint64_t Permutation::load(const uint8_t *block, uint8_t bytes) {
+  uint64_t word = 0;
+  uint8_t byte;
+  for (byte = 0; byte < bytes; byte++) word = (word << 8) | block[byte];
+  return word;
+}
+
+inline void Permutation::store(uint64_t word, uint8_t *block, uint8_t bytes) {
+  int byte;
+  for (byte = bytes - 1; byte >= 0; byte--, word >>= 8) block[byte] = word;
+}
+
+#endif  // PERMUTATION_H_
@@ -0,0 +1,145 @@
+/*
+ *  Copyright (C) 2019 Zachary Mohling
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "progress.h"
+
+#include <stdint.h>
+#include <stdio.h>
+#include <chrono>
+
+#include "stats.h"
+
+#define PROGRESS_BAR_WIDTH 40
+
+ProgressReporter::ProgressReporter(progress_sampler sample, void *arg,
+                                   uint64_t total, int mode,
+                                   std::ostream *out, int format)
+    : sample_(sample),
+      arg_(arg),
+      total_(total),
+      mode_(mode),
+      out_(out),
+      format_(format),
+      start_ns_(0),
+      stopping_(false) {}
+
+ProgressReporter::~ProgressReporter() {
+  if (thread_.joinable()) stop();
+}
+
+void ProgressReporter::start() {
+  start_ns_ = stats_now_ns();
+  stopping_ = false;
+  thread_ = std::thread(&ProgressReporter::run, this);
+}
+
+void ProgressReporter::stop() {
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    stopping_ = true;
+  }
+  wakeup_.notify_one();
+  thread_.join();
+
+  print(sample_(arg_), true);
+}
+
+/* Sample until stopped: at once and then every interval for the bar, *
+ * only every interval for lines, so that a short job logs nothing    *
+ * but its end.                                                       */
+void ProgressReporter::run() {
+  std::chrono::milliseconds interval(format_ == PROGRESS_BAR
+                                         ? PROGRESS_BAR_INTERVAL_MS
+                                         : PROGRESS_LINES_INTERVAL_MS);
+
+  if (format_ == PROGRESS_BAR) print(sample_(arg_), false);
+
+  std::unique_lock<std::mutex> lock(mutex_);
+  while (!wakeup_.wait_for(lock, interval, [this] { return stopping_; })) {
+    lock.unlock();
+    print(sample_(arg_), false);
+    lock.lock();
+  }
+}
+
+/* Write seconds as m:ss, or h:mm:ss from an hour up */
+static void format_duration(char *text, size_t size, double seconds) {
+  unsigned long total = (unsigned long)(seconds + 0.5);
+  unsigned long hours = total / 3600, minutes = (total / 60) % 60;
+
+  if (hours > 0)
+    snprintf(text, size, "%lu:%02lu:%02lu", hours, minutes, total % 60);
+  else
+    snprintf(text, size, "%lu:%02lu", minutes, total % 60);
+}
+
+/* Print done bytes of total. The counters may run past total by the  *
+ * padding, and the last sample lands at 100 no matter where they are. */
+void ProgressReporter::print(uint64_t done, bool final) {
+  if (total_ > 0 && (done > total_ || final)) done = total_;
+
+  double elapsed = (stats_now_ns() - start_ns_) / 1e9;
+  double rate = elapsed > 0 ? done / elapsed : 0;
+  double mb_rate = rate / (1024 * 1024);
+
+  char line[256];
+
+  if (format_ == PROGRESS_LINES) {
+    const char *action = (mode_ == 0) ? "encrypt" : "decrypt";
+    if (total_ > 0) {
+      double eta = rate > 0 ? (total_ - done) / rate : 0;
+      snprintf(line, sizeof(line),
+               "progress action=%s done=%llu total=%llu percent=%.1f "
+               "rate=%.0f eta=%.0f\n",
+               action, (unsigned long long)done,
+               (unsigned long long)total_, 100.0 * done / total_, rate, eta);
+    } else {
+      snprintf(line, sizeof(line),
+               "progress action=%s done=%llu rate=%.0f\n", action,
+               (unsigned long long)done, rate);
+    }
+
+    *out_ << line << std::flush;
+    return;
+  }
+
+  const char *action = (mode_ == 0) ? "Encrypting" : "Decrypting";
+  if (total_ > 0) {
+    double fraction = (double)done / total_;
+    int pos = (int)(PROGRESS_BAR_WIDTH * fraction);
+
+    char bar[PROGRESS_BAR_WIDTH + 1];
+    int i;
+    for (i = 0; i < PROGRESS_BAR_WIDTH; i++) {
+      bar[i] = (i < pos) ? '=' : (i == pos) ? '>' : ' ';
+    }
+    bar[PROGRESS_BAR_WIDTH] = '\0';
+
+    char eta[32] = "-:--";
+    if (rate > 0) format_duration(eta, sizeof(eta), (total_ - done) / rate);
+
+    snprintf(line, sizeof(line), "\r%s - [%s] %3d%%  %.1f MB/s  ETA %s   ",
+             action, bar, (int)(100 * fraction), mb_rate, eta);
+  } else {
+    snprintf(line, sizeof(line), "\r%s - %.1f MB  %.1f MB/s   ", action,
+             done / (1024.0 * 1024.0), mb_rate);
+  }
+
+  *out_ << line;
+  if (final) *out_ << std::endl;
+  out_->flush();
+}
@@ -0,0 +1,81 @@
+/*
+ *  Copyright (C) 2019 Zachary Mohling
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef PROGRESS_H_
+#define PROGRESS_H_
+
+#include <stdint.h>
+
+#include <condition_variable>
+#include <mutex>
+#include <ostream>
+#include <thread>
+
+/* How progress is shown: a bar redrawn in place for a terminal, or a   *
+ * line of key=value pairs per sample for a log or another program.     */
+#define PROGRESS_BAR 0
+#define PROGRESS_LINES 1
+
+/* Milliseconds between samples in each format */
+#define PROGRESS_BAR_INTERVAL_MS 200
+#define PROGRESS_LINES_INTERVAL_MS 2000
+
+/* Bytes of input done so far, read from the job's counters. Called on *
+ * the reporter's thread, so it may only load atomics.                 */
+typedef uint64_t (*progress_sampler)(void *arg);
+
+/* Reports the progress of a job from a thread of its own. The job only  *
+ * bumps its counters; every interval the reporter samples them through *
+ * sample and prints the percentage, throughput and time left of total  *
+ * bytes, or the bytes and throughput alone when total is 0, i.e. for a *
+ * stream. mode is 0 when encrypting and 1 when decrypting.             */
+class ProgressReporter {
+ public:
+  ProgressReporter(progress_sampler sample, void *arg, uint64_t total,
+                   int mode, std::ostream *out, int format);
+
+  ~ProgressReporter();
+
+  void start();
+
+  /* Stop sampling and print the job as done */
+  void stop();
+
+ private:
+  progress_sampler sample_;
+  void *arg_;
+  uint64_t total_;
+  int mode_;
+  std::ostream *out_;
+  int format_;
+
+  uint64_t start_ns_;
+
+  std::thread thread_;
+  std::mutex mutex_;
+  std::condition_variable wakeup_;
+  bool stopping_;
+
+  void run();
+
+  void print(uint64_t done, bool final);
+
+  ProgressReporter(const ProgressReporter &);
+  ProgressReporter &operator=(const ProgressReporter &);
+};
+
+#endif  // PROGRESS_H_
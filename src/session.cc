@@ -0,0 +1,1276 @@
+/*
+ *  Copyright (C) 2019 Zachary Mohling
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "session.h"
+
+#include <openssl/crypto.h>
+#include <openssl/rand.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <thread>
+#include <vector>
+
+#include "cpu_limits.h"
+#include "key_generator.h"
+#include "modes.h"
+
+/* A span of blocks split into work items for crypt_span. Lives on the *
+ * stack of the thread that waits for the items, which share it.       */
+struct Session::data_span {
+  uint8_t *out;
+  const uint8_t *in;
+  uint64_t length;
+  uint64_t num_blocks;
+  uint64_t blocks_per_item;
+  uint64_t num_items;
+  uint64_t nonce;
+  int mode;
+  uint64_t start_ns;
+  std::atomic<uint64_t> num_completed;
+};
+
+/* Add padding the last block of the file, of input length bytes in     *
+ * total. To PKCS#5 specification.                                      */
+static void add_PKCS5_padding(uint8_t *block, uint64_t length) {
+  uint8_t i, PKCS5_PADDING = 8 - (length % 8);
+  for (i = 0; i < PKCS5_PADDING; i++) {
+    block[(8 - PKCS5_PADDING) + i] = PKCS5_PADDING;
+  }
+}
+
+/* Length of the padding that ends at last_byte, or 0 if it is not 1 to  *
+ * BLOCK_SIZE bytes that all hold that length, as when the input was not *
+ * encrypted or used other keys. last_byte ends a whole block.          */
+static uint8_t PKCS5_padding_length(const uint8_t *last_byte) {
+  uint8_t padding = *last_byte, i;
+  if (padding < 1 || padding > BLOCK_SIZE) return 0;
+  for (i = 1; i < padding; i++) {
+    if (*(last_byte - i) != padding) return 0;
+  }
+  return padding;
+}
+
+static void abort_not_encrypted(bool in_streaming,
+                                const std::string &in_name) {
+  if (in_streaming) {
+    fprintf(stderr, "Aborting. Input is not an encrypted stream.\n");
+  } else {
+    fprintf(stderr, "Aborting. %s is not an encrypted file.\n",
+            in_name.c_str());
+  }
+  exit(-1);
+}
+
+/* The chunk size and ring depth left at zero take their defaults. CBC  *
+ * chunks are rounded up to whole segments.                             */
+Session::Session(const tdes_options *options, ThreadPool *pool)
+    : engine_(options->engine ? options->engine : engine_default()),
+      keys_(&own_keys_),
+      pool_(pool),
+      block_mode_(options->block_mode),
+      map_files_(options->map_files),
+      pin_cpus_(options->pin_cpus),
+      num_pin_cpus_(options->num_pin_cpus),
+      in_file_(NULL),
+      out_file_(NULL),
+      buffer_(NULL),
+      R_(0),
+      W_(0),
+      num_chunks_(0),
+      in_streaming_(false),
+      out_streaming_(false),
+      held_byte_(-1),
+      in_ended_(false),
+      in_file_length_(0),
+      out_file_length_(0),
+      in_header_(0),
+      out_header_(0),
+      data_length_(0),
+      nonce_(0),
+      keystream_(NULL),
+      item_parts_(NULL),
+      items_per_chunk_(0),
+      keystream_in_flight_(0),
+      read_length_(0),
+      write_length_(0),
+      num_operations_(0) {
+  reset_stats();
+
+  memset(own_keys_.schedules, 0, sizeof(own_keys_.schedules));
+  memset(&own_keys_.bitslice, 0, sizeof(own_keys_.bitslice));
+  own_keys_.bitsliced = true;
+
+  chunk_size_ = options->chunk_size ? options->chunk_size : DEFAULT_CHUNK_SIZE;
+  ring_depth_ = options->ring_depth;
+  if (!ring_depth_) {
+    ring_depth_ =
+        std::max((size_t)DEFAULT_RING_DEPTH, 2 * pool->size());
+  }
+
+  /* CBC chunks hold whole segments */
+  if (block_mode_ == BLOCK_MODE_CBC) {
+    chunk_size_ =
+        ((chunk_size_ - 1) / CBC_SEGMENT_SIZE + 1) * CBC_SEGMENT_SIZE;
+  }
+}
+
+Session::~Session() {
+  free(keystream_);
+  delete[] item_parts_;
+
+  free(buffer_);
+
+  OPENSSL_cleanse(&own_keys_, sizeof(own_keys_));
+}
+
+void Session::expand_key(const uint8_t key[24], key_schedule *K1,
+                         key_schedule *K2, key_schedule *K3) {
+  KeyGenerator::expand(key, K1);
+  KeyGenerator::expand(key + 8, K2);
+  KeyGenerator::expand(key + 16, K3);
+}
+
+void Session::set_keys(const key_schedule *K1, const key_schedule *K2,
+                       const key_schedule *K3) {
+  engine_load_keys(K1, K2, K3, engine_, &own_keys_);
+  keys_ = &own_keys_;
+}
+
+/* Keys prepared for the table engine have no bitslice masks; running *
+ * a bitsliced engine on them would silently use all-zero round keys.  */
+void Session::set_keys(const engine_keys *keys) {
+  assert(keys->bitsliced || !engine_->bitsliced);
+  keys_ = keys;
+}
+
+uint32_t Session::chunk_size() const { return chunk_size_; }
+
+uint32_t Session::ring_depth() const { return ring_depth_; }
+
+const tdes_engine *Session::engine() const { return engine_; }
+
+uint64_t Session::bytes_read() const { return read_length_; }
+
+uint64_t Session::bytes_done() const {
+  return num_operations_.load(std::memory_order_relaxed) * BLOCK_SIZE;
+}
+
+void Session::reset_stats() {
+  total_read_ = total_written_ = 0;
+  read_ns_ = cipher_ns_ = write_ns_ = 0;
+  read_wait_ns_ = write_wait_ns_ = 0;
+  num_items_ = 0;
+  latency_.reset();
+
+  stats_lock_wait_ns_ = pool_->lock_wait_ns();
+  stats_start_ns_ = stats_now_ns();
+}
+
+void Session::stats(pipeline_stats *out) const {
+  out->wall_ns = stats_now_ns() - stats_start_ns_;
+  out->num_workers = pool_->size();
+  out->bytes_read = total_read_;
+  out->bytes_written = total_written_;
+  out->read_ns = read_ns_;
+  out->cipher_ns = cipher_ns_;
+  out->write_ns = write_ns_;
+  out->read_wait_ns = read_wait_ns_;
+  out->write_wait_ns = write_wait_ns_;
+  out->lock_wait_ns = pool_->lock_wait_ns() - stats_lock_wait_ns_;
+  out->num_chunks = latency_.count();
+  out->num_items = num_items_;
+  out->latency_p50_ns = latency_.percentile(0.50);
+  out->latency_p90_ns = latency_.percentile(0.90);
+  out->latency_p99_ns = latency_.percentile(0.99);
+  out->latency_max_ns = latency_.max();
+
+  out->buffer_bytes = 0;
+  if (buffer_) out->buffer_bytes = (uint64_t)chunk_size_ * ring_depth_;
+  if (keystream_) out->buffer_bytes *= 2;
+  out->peak_memory_bytes = peak_memory_bytes();
+}
+
+void Session::count_item(uint64_t start_ns) {
+  cipher_ns_.fetch_add(stats_now_ns() - start_ns, std::memory_order_relaxed);
+  num_items_.fetch_add(1, std::memory_order_relaxed);
+}
+
+/* Once the last item is counted, the writer may write the chunk out and *
+ * return, so nothing of the session or the chunk is touched after it.   */
+void Session::finish_item(chunk_descriptor *chunk) {
+  ThreadPool *pool = pool_;
+  uint32_t num_expected = chunk->num_expected_callbacks;
+
+  if (chunk->num_callbacks.fetch_add(1, std::memory_order_acq_rel) + 1 ==
+      num_expected) {
+    pool->notify_waiters();
+  }
+}
+
+/* Encrypt or decrypt num_blocks blocks from in to out with the engine  *
+ * of the session. Runs shorter than the engine's batch go through the   *
+ * table engine, which does not pad them out to a batch.                 */
+void Session::crypt_blocks(uint8_t *out, const uint8_t *in,
+                           uint64_t num_blocks, int mode) const {
+  if (num_blocks >= engine_->min_blocks) {
+    engine_->crypt(out, in, num_blocks, keys_, mode == 1);
+  } else {
+    if (mode == 0)
+      keys_->table.encrypt_blocks(out, in, num_blocks);
+    else
+      keys_->table.decrypt_blocks(out, in, num_blocks);
+  }
+}
+
+/* CBC: IVs of num_segments segments from first_segment, the encrypted *
+ * counters nonce + k of segment k.                                    */
+void Session::cbc_ivs(uint8_t *ivs, uint64_t nonce, uint64_t first_segment,
+                      uint64_t num_segments) const {
+  ctr_counters(ivs, nonce, first_segment, num_segments);
+  crypt_blocks(ivs, ivs, num_segments, 0);
+}
+
+/* CBC: encrypt num_blocks blocks of the file with nonce, starting at    *
+ * segment first_segment, from in to out, which may be the same buffer.  *
+ * The chains of up to CBC_MAX_STREAMS segments advance together: block  *
+ * j of every segment is XORed with the previous ciphertext of its own   *
+ * segment and the blocks go through the cipher as one batch. Only the   *
+ * last segment may be short, so the segments still running are always   *
+ * the first ones.                                                       */
+void Session::cbc_encrypt(uint8_t *out, const uint8_t *in,
+                          uint64_t num_blocks, uint64_t nonce,
+                          uint64_t first_segment) const {
+  uint8_t ivs[CBC_MAX_STREAMS * BLOCK_SIZE];
+  uint8_t batch[CBC_MAX_STREAMS * BLOCK_SIZE];
+  uint64_t group_blocks = (uint64_t)CBC_MAX_STREAMS * CBC_SEGMENT_BLOCKS;
+
+  uint64_t done;
+  for (done = 0; done < num_blocks; done += group_blocks) {
+    uint64_t count = std::min(group_blocks, num_blocks - done);
+    uint64_t num_segments = (count - 1) / CBC_SEGMENT_BLOCKS + 1;
+    uint64_t last_blocks = count - (num_segments - 1) * CBC_SEGMENT_BLOCKS;
+
+    cbc_ivs(ivs, nonce, first_segment + (done / CBC_SEGMENT_BLOCKS),
+            num_segments);
+
+    const uint8_t *group_in = in + (done * BLOCK_SIZE);
+    uint8_t *group_out = out + (done * BLOCK_SIZE);
+
+    uint64_t block, segment;
+    for (block = 0; block < CBC_SEGMENT_BLOCKS; block++) {
+      uint64_t active = num_segments - (block < last_blocks ? 0 : 1);
+      if (active == 0) break;
+
+      for (segment = 0; segment < active; segment++) {
+        uint64_t at = (segment * CBC_SEGMENT_BLOCKS + block) * BLOCK_SIZE;
+        const uint8_t *chain = (block == 0) ? ivs + (segment * BLOCK_SIZE)
+                                            : group_out + at - BLOCK_SIZE;
+
+        xor_bytes(batch + (segment * BLOCK_SIZE), group_in + at, chain,
+                  BLOCK_SIZE);
+      }
+
+      crypt_blocks(batch, batch, active, 0);
+
+      for (segment = 0; segment < active; segment++) {
+        uint64_t at = (segment * CBC_SEGMENT_BLOCKS + block) * BLOCK_SIZE;
+        memcpy(group_out + at, batch + (segment * BLOCK_SIZE), BLOCK_SIZE);
+      }
+    }
+  }
+}
+
+/* CBC: decrypt num_blocks blocks of the file with nonce, starting at    *
+ * segment first_segment, from in to out, which may be the same buffer.  *
+ * Every ciphertext block is known, so a whole segment is decrypted at   *
+ * once and then XORed with the ciphertext before it, back to front so   *
+ * that in is read before out overwrites it.                             */
+void Session::cbc_decrypt(uint8_t *out, const uint8_t *in,
+                          uint64_t num_blocks, uint64_t nonce,
+                          uint64_t first_segment) const {
+  uint8_t ivs[CBC_MAX_STREAMS * BLOCK_SIZE];
+  uint8_t scratch[CBC_SEGMENT_SIZE];
+
+  uint64_t done;
+  for (done = 0; done < num_blocks; done += CBC_SEGMENT_BLOCKS) {
+    uint64_t segment = done / CBC_SEGMENT_BLOCKS;
+    uint64_t count = std::min((uint64_t)CBC_SEGMENT_BLOCKS, num_blocks - done);
+
+    if (segment % CBC_MAX_STREAMS == 0) {
+      uint64_t num_segments = (num_blocks - done - 1) / CBC_SEGMENT_BLOCKS + 1;
+      cbc_ivs(ivs, nonce, first_segment + segment,
+              std::min((uint64_t)CBC_MAX_STREAMS, num_segments));
+    }
+
+    const uint8_t *segment_in = in + (done * BLOCK_SIZE);
+    uint8_t *segment_out = out + (done * BLOCK_SIZE);
+
+    crypt_blocks(scratch, segment_in, count, 1);
+
+    uint64_t block;
+    for (block = count - 1; block > 0; block--) {
+      xor_bytes(segment_out + (block * BLOCK_SIZE),
+                scratch + (block * BLOCK_SIZE),
+                segment_in + ((block - 1) * BLOCK_SIZE), BLOCK_SIZE);
+    }
+    xor_bytes(segment_out, scratch,
+              ivs + ((segment % CBC_MAX_STREAMS) * BLOCK_SIZE), BLOCK_SIZE);
+  }
+}
+
+/* Read up to num_bytes of streaming input into buffer, stopping short *
+ * only at the end of the input. After a full read one more byte is    *
+ * read ahead and held for the next call, so that end is set on the    *
+ * call that returns the last of the input.                            */
+uint32_t Session::read_stream(uint8_t *data, uint32_t num_bytes,
+                              bool *end) {
+  uint64_t start_ns = stats_now_ns();
+
+  uint32_t done = 0;
+  if (held_byte_ >= 0 && num_bytes > 0) {
+    data[done++] = held_byte_;
+    held_byte_ = -1;
+  }
+
+  while (done < num_bytes && !in_ended_) {
+    ssize_t n = read(fileno(in_file_), data + done, num_bytes - done);
+    if (n < 0 && errno == EINTR) continue;
+    if (n < 0) {
+      fprintf(stderr, "Error: could not read input. %s.\n", strerror(errno));
+      exit(-7);
+    }
+    if (n == 0) in_ended_ = true;
+    done += n;
+  }
+
+  while (done == num_bytes && !in_ended_ && held_byte_ < 0) {
+    uint8_t byte;
+    ssize_t n = read(fileno(in_file_), &byte, 1);
+    if (n < 0 && errno == EINTR) continue;
+    if (n < 0) {
+      fprintf(stderr, "Error: could not read input. %s.\n", strerror(errno));
+      exit(-7);
+    }
+    if (n == 0)
+      in_ended_ = true;
+    else
+      held_byte_ = byte;
+  }
+
+  *end = in_ended_ && held_byte_ < 0;
+
+  read_length_.fetch_add(done, std::memory_order_relaxed);
+  read_ns_.fetch_add(stats_now_ns() - start_ns, std::memory_order_relaxed);
+  return done;
+}
+
+/* Fill chunk R from the input and return the bytes it will hold once   *
+ * padded. For the last chunk, adds the padding when encrypting and     *
+ * records num_chunks. Returns 0 only for an empty CTR stream.          */
+uint32_t Session::read_chunk(int mode, uint8_t *data) {
+  if (!in_streaming_) {
+    uint32_t num_bytes = (uint32_t)std::min((uint64_t)chunk_size_,
+                                            data_length_ - (R_ * chunk_size_));
+
+    read_task(data, in_header_ + (R_ * chunk_size_), num_bytes);
+
+    /* Add padding to last block of file. This padding ensures that the  *
+     * total new file length will evenly divide into BLOCK_SIZE. Padding *
+     * is to PKCS#5 specification.                                       */
+    if (R_ == num_chunks_ - 1 && mode == 0 && block_mode_ != BLOCK_MODE_CTR) {
+      add_PKCS5_padding(data + num_bytes - BLOCK_SIZE, in_file_length_);
+    }
+
+    return num_bytes;
+  }
+
+  bool end;
+  uint32_t length = read_stream(data, chunk_size_, &end), num_bytes = length;
+
+  if (block_mode_ == BLOCK_MODE_CTR) {
+    /* No padding. Only an empty input ends on an empty chunk. */
+    if (end && length == 0) {
+      num_chunks_.store(R_, std::memory_order_release);
+      return 0;
+    }
+  } else if (mode == 0) {
+    /* The padding block goes after the input. If the input ends on a   *
+     * full chunk, it gets a chunk of its own on the next call.         */
+    if (end && length < chunk_size_) {
+      num_bytes = length - (length % BLOCK_SIZE) + BLOCK_SIZE;
+      add_PKCS5_padding(data + num_bytes - BLOCK_SIZE, length);
+    } else {
+      end = false;
+    }
+  } else if (length % BLOCK_SIZE != 0 || (end && R_ == 0 && length == 0)) {
+    fprintf(stderr, "Aborting. Input is not an encrypted stream.\n");
+    exit(-1);
+  }
+
+  if (end) num_chunks_.store(R_ + 1, std::memory_order_release);
+
+  return num_bytes;
+}
+
+/* CTR: XOR the keystream of a work item into its data. Run by whichever *
+ * of the item's keystream and data became ready second.                 */
+void Session::ctr_xor_task(chunk_descriptor *chunk,
+                           const uint8_t *chunk_keystream, uint32_t item) {
+  uint64_t start_ns = stats_now_ns();
+
+  uint32_t offset = item * WORK_ITEM_SIZE;
+  uint32_t num_bytes =
+      std::min((uint32_t)WORK_ITEM_SIZE, chunk->num_bytes - offset);
+
+  xor_bytes(chunk->data + offset, chunk->data + offset,
+            chunk_keystream + offset, num_bytes);
+
+  num_operations_.fetch_add((num_bytes + BLOCK_SIZE - 1) / BLOCK_SIZE,
+                           std::memory_order_relaxed);
+  count_item(start_ns);
+
+  finish_item(chunk);
+}
+
+/* CTR: generate the keystream of chunk R, up to num_bytes of it, on the *
+ * pool while the chunk itself is being read.                            */
+void Session::ctr_keystream_ahead(chunk_descriptor *chunk,
+                                  uint32_t num_bytes) {
+  uint32_t slot = R_ % ring_depth_;
+  uint8_t *chunk_keystream = keystream_ + ((size_t)slot * chunk_size_);
+  std::atomic<uint8_t> *parts = item_parts_ + ((size_t)slot * items_per_chunk_);
+  uint64_t first_block = (R_ * chunk_size_) / BLOCK_SIZE;
+
+  uint32_t item, num_items = (num_bytes - 1) / WORK_ITEM_SIZE + 1;
+  for (item = 0; item < num_items; item++) {
+    parts[item].store(0, std::memory_order_relaxed);
+  }
+
+  keystream_in_flight_.fetch_add(num_items, std::memory_order_relaxed);
+
+  pool_->submit_bulk(num_items, [this, chunk, chunk_keystream, parts,
+                                 first_block, num_bytes](size_t item) {
+    uint64_t start_ns = stats_now_ns();
+
+    uint32_t offset = item * WORK_ITEM_SIZE;
+    uint32_t span_bytes =
+        std::min((uint32_t)WORK_ITEM_SIZE, num_bytes - offset);
+    uint32_t span_blocks = (span_bytes + BLOCK_SIZE - 1) / BLOCK_SIZE;
+
+    uint8_t *span = chunk_keystream + offset;
+    ctr_counters(span, nonce_, first_block + (offset / BLOCK_SIZE),
+                 span_blocks);
+    crypt_blocks(span, span, span_blocks, 0);
+    count_item(start_ns);
+
+    if (parts[item].fetch_add(1, std::memory_order_acq_rel) == 1) {
+      ctr_xor_task(chunk, chunk_keystream, item);
+    }
+
+    /* The writer may return once the last keystream item is counted */
+    ThreadPool *pool = pool_;
+    if (keystream_in_flight_.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+      pool->notify_waiters();
+    }
+  });
+}
+
+/* Read-ahead stage, run on its own thread. Reads chunks in order into *
+ * free slots of the ring, pads the last one, and hands each to the    *
+ * thread pool, staying at most ring_depth chunks ahead of the writer, *
+ * asleep while the ring is full. For CTR, the chunk's keystream is    *
+ * started before it is read.                                          */
+void Session::read_ahead(int mode, ChunkRing *ring) {
+  pin_thread(pin_cpus_, num_pin_cpus_, pool_->size() + PIN_READER);
+
+  for (R_ = 0; R_ < num_chunks_.load(std::memory_order_relaxed); R_++) {
+    chunk_descriptor *chunk = ring->try_acquire(R_);
+    if (chunk == NULL) {
+      /* Sleep until the writer frees the slot */
+      uint64_t wait_ns = stats_now_ns();
+      pool_->wait_until([this, ring, &chunk] {
+        return (chunk = ring->try_acquire(R_)) != NULL;
+      });
+      read_wait_ns_.fetch_add(stats_now_ns() - wait_ns,
+                              std::memory_order_relaxed);
+    }
+    chunk->start_ns = stats_now_ns();
+
+    if (block_mode_ == BLOCK_MODE_CTR) {
+      uint32_t expected_bytes = chunk_size_;
+      if (!in_streaming_) {
+        expected_bytes = (uint32_t)std::min((uint64_t)chunk_size_,
+                                            data_length_ - (R_ * chunk_size_));
+      }
+
+      ctr_keystream_ahead(chunk, expected_bytes);
+    }
+
+    uint32_t num_bytes = read_chunk(mode, chunk->data);
+    if (num_bytes == 0) {
+      /* Wake the writer to find the stream ended on the last chunk */
+      pool_->notify_waiters();
+      break;
+    }
+
+    /* Publish the chunk, then submit a work item for each span of       *
+     * WORK_ITEM_SIZE bytes to the threadpool in one batch.              */
+    uint32_t num_work_items = (num_bytes - 1) / WORK_ITEM_SIZE + 1;
+    ring->publish(chunk, num_bytes, num_work_items);
+
+    if (block_mode_ == BLOCK_MODE_CTR) {
+      uint32_t slot = R_ % ring_depth_;
+      uint8_t *chunk_keystream = keystream_ + ((size_t)slot * chunk_size_);
+      std::atomic<uint8_t> *parts =
+          item_parts_ + ((size_t)slot * items_per_chunk_);
+
+      uint32_t item;
+      for (item = 0; item < num_work_items; item++) {
+        if (parts[item].fetch_add(1, std::memory_order_acq_rel) == 1) {
+          pool_->submit([this, chunk, chunk_keystream, item] {
+            ctr_xor_task(chunk, chunk_keystream, item);
+          });
+        }
+      }
+      continue;
+    }
+
+    pool_->submit_bulk(num_work_items, [this, chunk, num_bytes,
+                                        mode](size_t item) {
+      uint32_t offset = item * WORK_ITEM_SIZE;
+      uint32_t span_bytes =
+          std::min((uint32_t)WORK_ITEM_SIZE, num_bytes - offset);
+
+      if (mode == 0)
+        encrypt_task(chunk, offset, span_bytes / BLOCK_SIZE);
+      else
+        decrypt_task(chunk, offset, span_bytes / BLOCK_SIZE);
+    });
+  }
+}
+
+/* Lay out the headers and lengths of block_mode. ECB has no header and  *
+ * pads the text. CTR and CBC put a nonce ahead of the ciphertext: drawn *
+ * at random and written out when encrypting, read from the front of the *
+ * input when decrypting. CBC pads the text like ECB.                    */
+void Session::init_layout(int mode, const std::string &in_name) {
+  bool padded = (block_mode_ != BLOCK_MODE_CTR);
+
+  in_header_ = out_header_ = 0;
+  if (block_mode_ != BLOCK_MODE_ECB) {
+    if (mode == 0)
+      out_header_ = NONCE_SIZE;
+    else
+      in_header_ = NONCE_SIZE;
+  }
+
+  if (mode == 0) {
+    /* round to even 8-byte block size */
+    data_length_ = in_file_length_;
+    if (padded) data_length_ += BLOCK_SIZE - (in_file_length_ % BLOCK_SIZE);
+    out_file_length_ = out_header_ + data_length_;
+  } else if (!in_streaming_) {
+    if (in_file_length_ < in_header_) {
+      fprintf(stderr, "Aborting. %s is not an encrypted file.\n",
+              in_name.c_str());
+      exit(-1);
+    }
+
+    data_length_ = in_file_length_ - in_header_;
+    if (padded && (data_length_ == 0 || data_length_ % BLOCK_SIZE != 0)) {
+      fprintf(stderr, "Aborting. %s is not an encrypted file.\n",
+              in_name.c_str());
+      exit(-1);
+    }
+    out_file_length_ = data_length_;
+  }
+
+  if (block_mode_ == BLOCK_MODE_ECB) return;
+
+  uint8_t header[NONCE_SIZE];
+
+  if (mode == 0) {
+    if (RAND_bytes(header, NONCE_SIZE) != 1) {
+      fprintf(stderr, "Could not generate a nonce.\n");
+      exit(-1);
+    }
+
+    write_task(header, 0, NONCE_SIZE);
+  } else if (in_streaming_) {
+    bool end;
+    if (read_stream(header, NONCE_SIZE, &end) != NONCE_SIZE) {
+      fprintf(stderr, "Aborting. Input is not an encrypted stream.\n");
+      exit(-1);
+    }
+  } else {
+    read_task(header, 0, NONCE_SIZE);
+  }
+
+  nonce_ = load_nonce(header);
+}
+
+/* Read the chunk at offset into the circular buffer. */
+void Session::read_task(uint8_t *data, uint64_t offset, uint32_t num_bytes) {
+  /* Bounds checking. The chunk holding the padding block may extend *
+   * past the end of the file, or lie entirely beyond it.            */
+  uint64_t start_ns = stats_now_ns();
+
+  uint32_t read_size = 0;
+  if (offset < in_file_length_) {
+    read_size = (uint32_t)std::min((uint64_t)num_bytes,
+                                   in_file_length_ - offset);
+  }
+
+  uint32_t done = 0;
+  while (done < read_size) {
+    ssize_t n = pread(fileno(in_file_), data + done, read_size - done,
+                      offset + done);
+    if (n < 0 && errno == EINTR) continue;
+    if (n <= 0) {
+      fprintf(stderr, "Error: could not read block starting at %llu. %s.\n",
+              (unsigned long long)(offset + done), strerror(errno));
+      exit(-7);
+    }
+    done += n;
+  }
+
+  read_length_.fetch_add(read_size, std::memory_order_relaxed);
+  read_ns_.fetch_add(stats_now_ns() - start_ns, std::memory_order_relaxed);
+}
+
+/* Write a span of the circular buffer to disk at offset. Streaming, *
+ * spans arrive in order and are simply appended.                    */
+void Session::write_task(uint8_t *data, uint64_t offset,
+                         uint32_t num_bytes) {
+  uint64_t start_ns = stats_now_ns();
+
+  uint32_t done = 0;
+  while (done < num_bytes) {
+    ssize_t n;
+    if (out_streaming_) {
+      n = write(fileno(out_file_), data + done, num_bytes - done);
+    } else {
+      n = pwrite(fileno(out_file_), data + done, num_bytes - done,
+                 offset + done);
+    }
+    if (n < 0 && errno == EINTR) continue;
+    if (n <= 0) {
+      fprintf(stderr, "Error: could not write block starting at %llu. %s.\n",
+              (unsigned long long)(offset + done), strerror(errno));
+      exit(-7);
+    }
+    done += n;
+  }
+
+  write_length_ += num_bytes;
+  write_ns_.fetch_add(stats_now_ns() - start_ns, std::memory_order_relaxed);
+}
+
+/* Encrypt the work item. On completion, increment the num_callbacks   *
+ * member of its chunk's descriptor.                                   */
+void Session::encrypt_task(chunk_descriptor *chunk, uint32_t offset,
+                           uint32_t num_blocks) {
+  uint64_t start_ns = stats_now_ns();
+  uint8_t *blocks = chunk->data + offset;
+
+  if (block_mode_ == BLOCK_MODE_CBC) {
+    uint64_t first_segment =
+        (chunk->index * chunk_size_ + offset) / CBC_SEGMENT_SIZE;
+    cbc_encrypt(blocks, blocks, num_blocks, nonce_, first_segment);
+  } else {
+    crypt_blocks(blocks, blocks, num_blocks, 0);
+  }
+
+  num_operations_.fetch_add(num_blocks, std::memory_order_relaxed);
+  count_item(start_ns);
+
+  finish_item(chunk);
+}
+
+/* Decrypt the work item. On completion, increment the num_callbacks   *
+ * member of its chunk's descriptor.                                   */
+void Session::decrypt_task(chunk_descriptor *chunk, uint32_t offset,
+                           uint32_t num_blocks) {
+  uint64_t start_ns = stats_now_ns();
+  uint8_t *blocks = chunk->data + offset;
+
+  if (block_mode_ == BLOCK_MODE_CBC) {
+    uint64_t first_segment =
+        (chunk->index * chunk_size_ + offset) / CBC_SEGMENT_SIZE;
+    cbc_decrypt(blocks, blocks, num_blocks, nonce_, first_segment);
+  } else {
+    crypt_blocks(blocks, blocks, num_blocks, 1);
+  }
+
+  num_operations_.fetch_add(num_blocks, std::memory_order_relaxed);
+  count_item(start_ns);
+
+  finish_item(chunk);
+}
+
+/* Allocate the circular buffer, and for CTR the keystream ring, on the *
+ * first buffered file. They are reused by every file of the session.   */
+void Session::alloc_buffers() {
+  if (buffer_) return;
+
+  if (!(buffer_ = (uint8_t *)malloc((size_t)chunk_size_ * ring_depth_))) {
+    fprintf(stderr, "Insufficient memory. ERROR: %d\n", errno);
+    exit(-1);
+  }
+
+  if (block_mode_ == BLOCK_MODE_CTR) {
+    items_per_chunk_ = (chunk_size_ - 1) / WORK_ITEM_SIZE + 1;
+    keystream_ = (uint8_t *)malloc((size_t)chunk_size_ * ring_depth_);
+    item_parts_ =
+        new std::atomic<uint8_t>[(size_t)items_per_chunk_ * ring_depth_];
+
+    if (!keystream_) {
+      fprintf(stderr, "Insufficient memory. ERROR: %d\n", errno);
+      exit(-1);
+    }
+  }
+}
+
+/* Stream the input through the circular buffer. A read-ahead thread     *
+ * fills the ring and feeds the thread pool while this thread writes     *
+ * completed chunks behind it, so reading, the cipher and writing all    *
+ * overlap. Both sleep on the pool while they wait, so they take no CPU  *
+ * from the workers.                                                     */
+void Session::run_buffered(int mode, const std::string &in_name) {
+  alloc_buffers();
+
+  /* Streaming, the read-ahead thread finds the chunk count at the end */
+  if (in_streaming_) {
+    num_chunks_ = UINT64_MAX;
+  } else {
+    num_chunks_ = (data_length_ + chunk_size_ - 1) / chunk_size_;
+  }
+
+  /* Descriptors of the chunks of buffer. Workers signal completion of *
+   * their work item on the chunk's descriptor, and a chunk is written *
+   * to disk once all of its work items have called back.              */
+  ChunkRing ring(buffer_, chunk_size_, ring_depth_);
+
+  std::thread reader(&Session::read_ahead, this, mode, &ring);
+
+  while (W_ < num_chunks_.load(std::memory_order_acquire)) {
+    chunk_descriptor *chunk = ring.try_complete(W_);
+    if (chunk == NULL) {
+      /* Sleep until a worker finishes a chunk, or the reader finds that *
+       * a stream has ended                                              */
+      uint64_t wait_ns = stats_now_ns();
+      pool_->wait_until([this, &ring, &chunk] {
+        return W_ >= num_chunks_.load(std::memory_order_acquire) ||
+               (chunk = ring.try_complete(W_)) != NULL;
+      });
+      write_wait_ns_.fetch_add(stats_now_ns() - wait_ns,
+                               std::memory_order_relaxed);
+      if (chunk == NULL) continue;
+    }
+
+    /* Write behind: take up to MAX_WRITE_CHUNKS completed chunks that  *
+     * follow W and sit next to it in the buffer, and write them as one *
+     * span.                                                            */
+    uint64_t num_ready = 1;
+    uint32_t num_bytes = chunk->num_bytes;
+    while (num_ready < MAX_WRITE_CHUNKS && W_ + num_ready < num_chunks_ &&
+           (W_ + num_ready) % ring_depth_ != 0) {
+      chunk_descriptor *next = ring.try_complete(W_ + num_ready);
+      if (next == NULL) break;
+
+      num_bytes += next->num_bytes;
+      num_ready++;
+    }
+
+    /* If last block, de-pad by shortening the length of the write *
+     * operation.                                                  */
+    if (W_ + num_ready == num_chunks_ && mode == 1 &&
+        block_mode_ != BLOCK_MODE_CTR) {
+      uint8_t padding = PKCS5_padding_length(chunk->data + num_bytes - 1);
+      if (padding == 0) abort_not_encrypted(in_streaming_, in_name);
+      num_bytes -= padding;
+    }
+
+    write_task(chunk->data, out_header_ + (W_ * chunk_size_), num_bytes);
+
+    uint64_t written_ns = stats_now_ns(), i;
+    for (i = 0; i < num_ready; i++, W_++) {
+      chunk_descriptor *written = ring.try_complete(W_);
+      latency_.record(written_ns - written->start_ns);
+      ring.release(written);
+    }
+    pool_->notify_waiters();
+  }
+
+  reader.join();
+
+  /* Keystream of a chunk past the end of a stream may still be running */
+  pool_->wait_until([this] {
+    return keystream_in_flight_.load(std::memory_order_acquire) == 0;
+  });
+}
+
+/* Encrypt or decrypt num_blocks blocks from the input map straight into *
+ * the output map.                                                       */
+void Session::map_task(uint8_t *out, const uint8_t *in, uint64_t num_blocks,
+                       int mode) {
+  crypt_blocks(out, in, num_blocks, mode);
+
+  num_operations_.fetch_add(num_blocks, std::memory_order_relaxed);
+}
+
+/* CBC: encrypt or decrypt num_blocks blocks, starting at segment      *
+ * first_segment, from the input map straight into the output map.     */
+void Session::cbc_map_task(uint8_t *out, const uint8_t *in,
+                           uint64_t num_blocks, uint64_t nonce,
+                           uint64_t first_segment, int mode) {
+  if (mode == 0)
+    cbc_encrypt(out, in, num_blocks, nonce, first_segment);
+  else
+    cbc_decrypt(out, in, num_blocks, nonce, first_segment);
+
+  num_operations_.fetch_add(num_blocks, std::memory_order_relaxed);
+}
+
+/* CTR: XOR num_bytes from in into out with the keystream of nonce that *
+ * starts at block first_block, generated in batches on the stack.      */
+void Session::ctr_map_task(uint8_t *out, const uint8_t *in,
+                           uint64_t num_bytes, uint64_t nonce,
+                           uint64_t first_block) {
+  uint8_t batch[CTR_BATCH_BLOCKS * BLOCK_SIZE];
+
+  uint64_t done = 0;
+  while (done < num_bytes) {
+    uint64_t span_bytes = std::min((uint64_t)sizeof(batch), num_bytes - done);
+    uint64_t span_blocks = (span_bytes + BLOCK_SIZE - 1) / BLOCK_SIZE;
+
+    ctr_counters(batch, nonce, first_block + (done / BLOCK_SIZE), span_blocks);
+    crypt_blocks(batch, batch, span_blocks, 0);
+    xor_bytes(out + done, in + done, batch, span_bytes);
+
+    num_operations_.fetch_add(span_blocks, std::memory_order_relaxed);
+    done += span_bytes;
+  }
+}
+
+/* Run one work item of span: blocks_per_item blocks, fewer for the last. */
+void Session::span_item(data_span *span, size_t item) {
+  uint64_t start_ns = stats_now_ns();
+  uint64_t first = item * span->blocks_per_item;
+  uint64_t count = std::min(span->blocks_per_item, span->num_blocks - first);
+
+  uint8_t *out = span->out + (first * BLOCK_SIZE);
+  const uint8_t *in = span->in + (first * BLOCK_SIZE);
+
+  if (block_mode_ == BLOCK_MODE_CTR) {
+    uint64_t num_bytes =
+        std::min(count * BLOCK_SIZE, span->length - (first * BLOCK_SIZE));
+    ctr_map_task(out, in, num_bytes, span->nonce, first);
+  } else if (block_mode_ == BLOCK_MODE_CBC) {
+    cbc_map_task(out, in, count, span->nonce, first / CBC_SEGMENT_BLOCKS,
+                 span->mode);
+  } else {
+    map_task(out, in, count, span->mode);
+  }
+
+  count_item(start_ns);
+  latency_.record(stats_now_ns() - span->start_ns);
+
+  /* The span, and maybe the session, may be gone once the last item is *
+   * counted                                                            */
+  ThreadPool *pool = pool_;
+  uint64_t num_items = span->num_items;
+  if (span->num_completed.fetch_add(1, std::memory_order_acq_rel) + 1 ==
+      num_items) {
+    pool->notify_waiters();
+  }
+}
+
+/* Encrypt or decrypt the length bytes of text at in into out, split into *
+ * work items on the pool. Encrypting ECB or CBC, out receives the padded *
+ * text, its final block, or for CBC its final segment, padded and        *
+ * encrypted here while the items run. Decrypting, the padding is left    *
+ * in out for the caller to strip.                                        *
+ *                                                                        *
+ * A worker of the pool cannot wait on items queued behind it, so when    *
+ * this thread is one, or there is a single item, the items run here.     */
+void Session::crypt_span(int mode, uint8_t *out, const uint8_t *in,
+                         uint64_t length, uint64_t nonce) {
+  data_span span;
+  span.out = out;
+  span.in = in;
+  span.length = length;
+  span.nonce = nonce;
+  span.mode = mode;
+  span.start_ns = stats_now_ns();
+  span.num_completed.store(0, std::memory_order_relaxed);
+
+  /* Whole blocks of input. Encrypting ECB, the partial or empty last   *
+   * block is left for the padding step, and encrypting CBC, the whole  *
+   * segment it ends; CTR takes a partial last block as it is.          */
+  uint64_t padded_length = length + (BLOCK_SIZE - (length % BLOCK_SIZE));
+  span.num_blocks = length / BLOCK_SIZE;
+  if (block_mode_ == BLOCK_MODE_CTR) {
+    span.num_blocks = (length + BLOCK_SIZE - 1) / BLOCK_SIZE;
+  } else if (mode == 0 && block_mode_ == BLOCK_MODE_CBC) {
+    span.num_blocks = ((padded_length / BLOCK_SIZE - 1) / CBC_SEGMENT_BLOCKS) *
+                      CBC_SEGMENT_BLOCKS;
+  }
+
+  /* Split the blocks into work items of at least MAP_WORK_ITEM_SIZE     *
+   * bytes, and few enough that every item fits in the pool's queues.    */
+  span.blocks_per_item = MAP_WORK_ITEM_SIZE / BLOCK_SIZE;
+  uint64_t max_items = pool_->size() * MAP_ITEMS_PER_WORKER;
+  if (span.num_blocks > span.blocks_per_item * max_items) {
+    span.blocks_per_item = (span.num_blocks - 1) / max_items + 1;
+  }
+
+  /* CBC items start on a segment */
+  if (block_mode_ == BLOCK_MODE_CBC) {
+    span.blocks_per_item =
+        ((span.blocks_per_item - 1) / CBC_SEGMENT_BLOCKS + 1) *
+        CBC_SEGMENT_BLOCKS;
+  }
+
+  span.num_items = 0;
+  if (span.num_blocks > 0) {
+    span.num_items = (span.num_blocks - 1) / span.blocks_per_item + 1;
+  }
+
+  if (span.num_items <= 1 || this_pool_worker().pool == pool_) {
+    uint64_t item;
+    for (item = 0; item < span.num_items; item++) span_item(&span, item);
+  } else {
+    data_span *shared = &span;
+    pool_->submit_bulk(span.num_items, [this, shared](size_t item) {
+      span_item(shared, item);
+    });
+  }
+
+  uint64_t start = span.num_blocks * BLOCK_SIZE;
+  if (mode == 0 && block_mode_ == BLOCK_MODE_ECB) {
+    uint8_t block[BLOCK_SIZE];
+
+    if (length > start) memcpy(block, in + start, length - start);
+    add_PKCS5_padding(block, length);
+
+    crypt_blocks(out + start, block, 1, 0);
+  } else if (mode == 0 && block_mode_ == BLOCK_MODE_CBC) {
+    uint8_t segment[CBC_SEGMENT_SIZE];
+    uint64_t segment_bytes = padded_length - start;
+
+    if (length > start) memcpy(segment, in + start, length - start);
+    add_PKCS5_padding(segment + segment_bytes - BLOCK_SIZE, length);
+
+    cbc_encrypt(out + start, segment, segment_bytes / BLOCK_SIZE, nonce,
+                span.num_blocks / CBC_SEGMENT_BLOCKS);
+  }
+
+  /* Sleep until the last item is done */
+  data_span *shared = &span;
+  auto done = [shared] {
+    return shared->num_completed.load(std::memory_order_acquire) ==
+           shared->num_items;
+  };
+  if (done()) return;
+
+  uint64_t wait_ns = stats_now_ns();
+  pool_->wait_until(done);
+  write_wait_ns_.fetch_add(stats_now_ns() - wait_ns, std::memory_order_relaxed);
+}
+
+bool Session::run_mapped(int mode, const std::string &in_name) {
+  if (in_streaming_ || out_streaming_ || data_length_ == 0) return false;
+
+  int in_fd = fileno(in_file_), out_fd = fileno(out_file_);
+
+  struct stat in_stat, out_stat;
+  if (fstat(in_fd, &in_stat) != 0 || fstat(out_fd, &out_stat) != 0 ||
+      !S_ISREG(in_stat.st_mode) || !S_ISREG(out_stat.st_mode) ||
+      out_file_length_ > (uint64_t)SIZE_MAX) {
+    return false;
+  }
+
+  uint8_t *in_map = NULL, *out_map;
+
+  if (in_file_length_ > 0) {
+    void *map = mmap(NULL, in_file_length_, PROT_READ, MAP_SHARED, in_fd, 0);
+    if (map == MAP_FAILED) return false;
+
+    in_map = (uint8_t *)map;
+    madvise(in_map, in_file_length_, MADV_SEQUENTIAL);
+  }
+
+  /* Reserve the blocks of the output before mapping it, so that running *
+   * out of space fails here instead of faulting in a worker.            */
+#if defined(__linux__)
+  int error = posix_fallocate(out_fd, 0, out_file_length_);
+  if (error == ENOSPC) {
+    fprintf(stderr, "Could not allocate output file. ERROR: %d\n", error);
+    exit(-7);
+  }
+  if (error != 0 && ftruncate(out_fd, out_file_length_) != 0) {
+#else
+  if (ftruncate(out_fd, out_file_length_) != 0) {
+#endif
+    if (in_map) munmap(in_map, in_file_length_);
+    return false;
+  }
+
+  void *map = mmap(NULL, out_file_length_, PROT_READ | PROT_WRITE, MAP_SHARED,
+                   out_fd, 0);
+  if (map == MAP_FAILED) {
+    if (in_map) munmap(in_map, in_file_length_);
+    if (ftruncate(out_fd, out_header_) != 0) exit(-7);
+    return false;
+  }
+
+  out_map = (uint8_t *)map;
+  madvise(out_map, out_file_length_, MADV_SEQUENTIAL);
+
+  uint8_t *in_data = in_map + in_header_, *out_data = out_map + out_header_;
+  uint64_t length = (mode == 0) ? in_file_length_ : data_length_;
+
+  crypt_span(mode, out_data, in_data, length, nonce_);
+
+  uint64_t padding = 0;
+  if (mode == 1 && block_mode_ != BLOCK_MODE_CTR) {
+    padding = PKCS5_padding_length(out_map + out_file_length_ - 1);
+    if (padding == 0) abort_not_encrypted(false, in_name);
+  }
+
+  read_length_ = in_file_length_;
+  write_length_ = out_file_length_ - padding;
+
+  if (in_map) munmap(in_map, in_file_length_);
+  munmap(out_map, out_file_length_);
+
+  if (padding > 0 && ftruncate(out_fd, out_file_length_ - padding) != 0) {
+    fprintf(stderr, "Error: could not truncate output. %s.\n", strerror(errno));
+    exit(-7);
+  }
+
+  return true;
+}
+
+uint64_t Session::max_output_length(uint64_t in_length) const {
+  return NONCE_SIZE + in_length + BLOCK_SIZE;
+}
+
+bool Session::crypt_buffer(int mode, const uint8_t *in, uint64_t in_length,
+                           uint8_t *out, uint64_t *out_length) {
+  uint32_t header = (block_mode_ == BLOCK_MODE_ECB) ? 0 : NONCE_SIZE;
+  bool padded = (block_mode_ != BLOCK_MODE_CTR);
+  uint64_t buffer_nonce = 0;
+
+  if (mode == 0) {
+    if (header) {
+      if (RAND_bytes(out, NONCE_SIZE) != 1) return false;
+      buffer_nonce = load_nonce(out);
+    }
+
+    *out_length = header + in_length;
+    if (padded) *out_length += BLOCK_SIZE - (in_length % BLOCK_SIZE);
+
+    crypt_span(mode, out + header, in, in_length, buffer_nonce);
+
+    total_read_.fetch_add(in_length, std::memory_order_relaxed);
+    total_written_.fetch_add(*out_length, std::memory_order_relaxed);
+    return true;
+  }
+
+  if (in_length < header) return false;
+
+  uint64_t length = in_length - header;
+  if (padded && (length == 0 || length % BLOCK_SIZE != 0)) return false;
+
+  if (header) buffer_nonce = load_nonce(in);
+
+  crypt_span(mode, out, in + header, length, buffer_nonce);
+
+  /* Strip the padding */
+  *out_length = length;
+  if (padded) {
+    uint8_t padding = PKCS5_padding_length(out + length - 1);
+    if (padding == 0) return false;
+    *out_length -= padding;
+  }
+
+  total_read_.fetch_add(in_length, std::memory_order_relaxed);
+  total_written_.fetch_add(*out_length, std::memory_order_relaxed);
+  return true;
+}
+
+void Session::crypt_file(int mode, FILE *in, bool in_streaming, FILE *out,
+                         bool out_streaming, const std::string &in_name) {
+  in_file_ = in;
+  out_file_ = out;
+  in_streaming_ = in_streaming;
+  out_streaming_ = out_streaming;
+
+  struct stat in_stat;
+  in_file_length_ = 0;
+  if (!in_streaming_ && fstat(fileno(in_file_), &in_stat) == 0) {
+    in_file_length_ = in_stat.st_size;
+  }
+  out_file_length_ = 0;
+
+  R_ = W_ = 0;
+  held_byte_ = -1;
+  in_ended_ = false;
+  read_length_ = write_length_ = 0;
+
+  /* Headers, padding and lengths of the block mode */
+  init_layout(mode, in_name);
+
+  if (!map_files_ || !run_mapped(mode, in_name)) run_buffered(mode, in_name);
+
+  total_read_ += read_length_;
+  total_written_ += write_length_;
+}
+
+/* Encrypt sample into scratch the way crypt_file does, with the chunk  *
+ * size and ring depth of this session. Returns the seconds it took.    */
+double Session::time_configuration(FILE *sample, FILE *scratch) {
+  auto start = std::chrono::steady_clock::now();
+
+  crypt_file(0, sample, false, scratch, false, "calibration sample");
+
+  return std::chrono::duration<double>(std::chrono::steady_clock::now() -
+                                       start)
+      .count();
+}
+
+/* Deep enough a ring to keep every worker busy, within MAX_RING_MEMORY */
+static uint32_t tuned_ring_depth(unsigned num_workers, uint32_t chunk_size) {
+  uint32_t depth = std::max((unsigned)DEFAULT_RING_DEPTH, 4 * num_workers);
+  depth = std::min(depth, (uint32_t)(MAX_RING_MEMORY / chunk_size));
+  return std::max(depth, (uint32_t)MIN_RING_DEPTH);
+}
+
+void Session::autotune(const tdes_options *options, unsigned cpus,
+                       uint64_t file_length, tdes_options *tuned) {
+  *tuned = *options;
+
+  std::vector<unsigned> worker_counts;
+  if (options->num_workers) {
+    worker_counts.push_back(options->num_workers);
+  } else {
+    unsigned count;
+    for (count = 1; count < cpus; count *= 2) worker_counts.push_back(count);
+    worker_counts.push_back(cpus);
+  }
+
+  /* No point in chunks much larger than the file itself */
+  std::vector<uint32_t> chunk_sizes;
+  if (options->chunk_size) {
+    chunk_sizes.push_back(options->chunk_size);
+  } else {
+    uint32_t size;
+    for (size = 16 * 1024; size <= 1024 * 1024; size *= 4) {
+      if (size > 16 * 1024 && size / 2 > file_length) break;
+      chunk_sizes.push_back(size);
+    }
+  }
+
+  /* Nothing left to choose between when both were given, or when there *
+   * is a single CPU and the chunk size was given                        */
+  if (worker_counts.size() == 1 && chunk_sizes.size() == 1) {
+    tuned->num_workers = worker_counts[0];
+    tuned->chunk_size = chunk_sizes[0];
+    if (!options->ring_depth) {
+      tuned->ring_depth = tuned_ring_depth(tuned->num_workers,
+                                           tuned->chunk_size);
+    }
+    return;
+  }
+
+  /* Enough of a sample for a few chunks of every candidate, but never a *
+   * large one because a large chunk size was given                      */
+  uint32_t sample_size = AUTOTUNE_SAMPLE_SIZE;
+  sample_size = std::max(sample_size, AUTOTUNE_SAMPLE_CHUNKS *
+                                          chunk_sizes.back());
+  sample_size = std::min(sample_size, (uint32_t)AUTOTUNE_MAX_SAMPLE_SIZE);
+
+  /* The probes read the sample from a scratch file and write to another */
+  FILE *sample = tmpfile(), *scratch = tmpfile();
+  if (!sample || !scratch) {
+    fprintf(stderr, "Could not create calibration files. ERROR: %d\n",
+            errno);
+    exit(-1);
+  }
+
+  std::vector<uint8_t> zeros(sample_size, 0);
+  if (fwrite(zeros.data(), 1, sample_size, sample) != sample_size ||
+      fflush(sample) != 0) {
+    fprintf(stderr, "Could not write calibration sample. ERROR: %d\n",
+            errno);
+    exit(-1);
+  }
+
+  /* The probes encrypt in the block mode asked for under an all-zero key */
+  tdes_options probe_options = *options;
+
+  key_schedule zero_key;
+  memset(&zero_key, 0, sizeof(zero_key));
+
+  double best_rate = 0;
+  size_t w, c;
+  for (w = 0; w < worker_counts.size(); w++) {
+    ThreadPool pool(worker_counts[w]);
+
+    for (c = 0; c < chunk_sizes.size(); c++) {
+      probe_options.chunk_size = chunk_sizes[c];
+      probe_options.ring_depth = options->ring_depth;
+      if (!probe_options.ring_depth) {
+        probe_options.ring_depth =
+            tuned_ring_depth(worker_counts[w], chunk_sizes[c]);
+      }
+
+      Session probe(&probe_options, &pool);
+      probe.set_keys(&zero_key, &zero_key, &zero_key);
+
+      double seconds = probe.time_configuration(sample, scratch);
+      double rate = sample_size / std::max(seconds, 1e-9);
+
+      bool more_workers = (worker_counts[w] > tuned->num_workers);
+      if (best_rate == 0 || rate > best_rate * (more_workers ? 1.05 : 1.0)) {
+        best_rate = rate;
+        tuned->num_workers = worker_counts[w];
+        tuned->chunk_size = chunk_sizes[c];
+      }
+    }
+  }
+
+  fclose(sample);
+  fclose(scratch);
+
+  if (!options->ring_depth) {
+    tuned->ring_depth = tuned_ring_depth(tuned->num_workers,
+                                         tuned->chunk_size);
+  }
+}
@@ -0,0 +1,313 @@
+/*
+ *  Copyright (C) 2019 Zachary Mohling
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef SESSION_H_
+#define SESSION_H_
+
+#include <stdint.h>
+#include <stdio.h>
+
+#include <atomic>
+#include <string>
+
+#include "../lib/ThreadPool.h"
+#include "chunk_ring.h"
+#include "cipher.h"
+#include "engine.h"
+#include "stats.h"
+
+/* Geometry of the circular buffer: bytes per chunk and chunks in the   *
+ * ring, which bounds how far reads run ahead of writes. Both can be    *
+ * set at runtime; these are the defaults and limits. A chunk size is a *
+ * multiple of BLOCK_SIZE.                                              */
+#define DEFAULT_CHUNK_SIZE (64 * 1024)
+#define MAX_CHUNK_SIZE (256 * 1024 * 1024)
+#define DEFAULT_RING_DEPTH 16
+#define MIN_RING_DEPTH 2
+
+/* Most bytes of the ring the autotuner will allocate */
+#define MAX_RING_MEMORY (256 * 1024 * 1024)
+
+/* Bytes of input the autotuner encrypts per candidate configuration, *
+ * and at least this many chunks of the largest candidate, up to at   *
+ * most AUTOTUNE_MAX_SAMPLE_SIZE bytes                                */
+#define AUTOTUNE_SAMPLE_SIZE (2 * 1024 * 1024)
+#define AUTOTUNE_SAMPLE_CHUNKS 4
+#define AUTOTUNE_MAX_SAMPLE_SIZE (16 * 1024 * 1024)
+
+/* Most bytes of a chunk handed to the thread pool as one work item. A  *
+ * multiple of BLOCK_SIZE; larger chunks are split.                     */
+#define WORK_ITEM_SIZE (64 * 1024)
+
+/* Most completed chunks the writer gathers into one write */
+#define MAX_WRITE_CHUNKS 8
+
+/* Smallest work item when the files are memory-mapped, and the most work *
+ * items queued per pool worker, which bounds the item count for large    *
+ * files.                                                                 */
+#define MAP_WORK_ITEM_SIZE (64 * 1024)
+#define MAP_ITEMS_PER_WORKER 64
+
+/* Options from the command line. block_mode is one of the BLOCK_MODE_   *
+ * values of modes.h, ECB by default. Zero values are chosen at runtime: *
+ * the worker count from the CPUs available to the process, and the      *
+ * chunk size and ring depth from the defaults, or by a short            *
+ * calibration pass when autotune is set. A NULL engine is the fastest   *
+ * the host supports. stats is the STATS_ format of stats.h in which to  *
+ * report the pipeline's counters once the job is done.                  *
+ *                                                                       *
+ * pin_cpus, when num_pin_cpus is not 0, lists the CPUs to pin threads   *
+ * to: worker i to the i-th, then the writer and then the reader to the  *
+ * next two, wrapping around a shorter list.                             */
+typedef struct tdes_options {
+  int block_mode;
+  bool map_files;
+  bool autotune;
+  uint32_t chunk_size;
+  uint32_t ring_depth;
+  unsigned num_workers;
+  const tdes_engine *engine;
+  int stats;
+  const unsigned *pin_cpus;
+  unsigned num_pin_cpus;
+} tdes_options;
+
+/* Where the threads of a pipeline are pinned in pin_cpus, after the *
+ * workers                                                           */
+#define PIN_WRITER 0
+#define PIN_READER 1
+
+/* One encryption or decryption context: the key schedules, the block     *
+ * mode, the circular buffer and the state of the pipeline. Everything a  *
+ * run touches lives here, so any number of sessions may run at once,     *
+ * sharing one thread pool. mode is 0 to encrypt and 1 to decrypt.        *
+ *                                                                        *
+ * crypt_buffer may be called from several threads at once, including     *
+ * from the pool's own workers, in which case it runs on the calling      *
+ * thread. crypt_file runs one file at a time and owns the session until  *
+ * it returns.                                                            */
+class Session {
+ public:
+  Session(const tdes_options *options, ThreadPool *pool);
+
+  ~Session();
+
+  /* Expand the 24 bytes of K1, K2 and K3 into their schedules */
+  static void expand_key(const uint8_t key[24], key_schedule *K1,
+                         key_schedule *K2, key_schedule *K3);
+
+  void set_keys(const key_schedule *K1, const key_schedule *K2,
+                const key_schedule *K3);
+
+  /* Use keys already expanded for engine(), e.g. by engine_expand_keys. *
+   * They are not copied, so switching between prepared key sets is free, *
+   * and must outlive their use by the session.                           */
+  void set_keys(const engine_keys *keys);
+
+  /* Most bytes crypt_buffer writes for in_length bytes of input */
+  uint64_t max_output_length(uint64_t in_length) const;
+
+  /* Encrypt or decrypt in_length bytes from in into out, which must not *
+   * overlap it, in the format crypt_file writes. Returns false if in is *
+   * not something this session could have encrypted.                    */
+  bool crypt_buffer(int mode, const uint8_t *in, uint64_t in_length,
+                    uint8_t *out, uint64_t *out_length);
+
+  /* Encrypt or decrypt in into out. A stream, such as a pipe, is read or *
+   * written in order, its length unknown; anything else is accessed at   *
+   * offsets, and memory-mapped when the options ask for it. in_name is   *
+   * for messages.                                                        */
+  void crypt_file(int mode, FILE *in, bool in_streaming, FILE *out,
+                  bool out_streaming, const std::string &in_name);
+
+  /* Bytes of the running file read so far */
+  uint64_t bytes_read() const;
+
+  /* Bytes through the cipher since the session was made, over every  *
+   * file and buffer, in whole blocks: padding adds up to a block per *
+   * file. Only loads an atomic, so any thread may sample it.         */
+  uint64_t bytes_done() const;
+
+  /* Start the counters of stats over, and the clock of its wall time */
+  void reset_stats();
+
+  /* Counters of every file and buffer run since the last reset_stats, *
+   * or since the session was made                                     */
+  void stats(pipeline_stats *out) const;
+
+  uint32_t chunk_size() const;
+
+  uint32_t ring_depth() const;
+
+  const tdes_engine *engine() const;
+
+  /* Calibration pass. Encrypts a sample file into a scratch file, read, *
+   * ciphered and written the way crypt_file does, with every candidate  *
+   * pair of worker count and chunk size that options left open, and     *
+   * stores the fastest in tuned, along with a ring depth deep enough to *
+   * keep every worker busy. file_length bounds the chunk sizes tried;   *
+   * UINT64_MAX if unknown.                                              */
+  static void autotune(const tdes_options *options, unsigned cpus,
+                       uint64_t file_length, tdes_options *tuned);
+
+ private:
+  struct data_span;
+
+  /* Engine of the session, and the keys it runs under: own_keys_ or a *
+   * prepared set of the caller's                                      */
+  const tdes_engine *engine_;
+  engine_keys own_keys_;
+  const engine_keys *keys_;
+
+  ThreadPool *pool_;
+  int block_mode_;
+  bool map_files_;
+
+  /* CPUs to pin the read-ahead thread to, see tdes_options */
+  const unsigned *pin_cpus_;
+  unsigned num_pin_cpus_;
+
+  FILE *in_file_, *out_file_;
+
+  /* Circular buffer of ring_depth_ chunks of chunk_size_ bytes,        *
+   * allocated on the first buffered file and kept for the next.        */
+  uint8_t *buffer_;
+  uint32_t chunk_size_, ring_depth_;
+
+  /* Counters of chunks in buffer. R_ is the index of the next chunk to *
+   * read data into from disk, advanced by the read-ahead thread, while *
+   * W_ is the index of the next chunk which to read from the buffer    *
+   * and write to disk. Chunk i lives at slot i % ring_depth_.          */
+  uint64_t R_, W_;
+
+  /* Chunks in the whole file. Known up front for files; when streaming, *
+   * set by the read-ahead thread once it reaches the end of the input,  *
+   * before it publishes the last chunk.                                 */
+  std::atomic<uint64_t> num_chunks_;
+
+  /* Whether the input or output is a stream, and for streaming input a *
+   * byte read past a full chunk to learn whether the input ends there, *
+   * or -1, and whether the end has been seen.                          */
+  bool in_streaming_, out_streaming_;
+  int held_byte_;
+  bool in_ended_;
+
+  uint64_t in_file_length_, out_file_length_;
+
+  /* Bytes before the data in the input and output: the nonce on the     *
+   * ciphertext side for CTR and CBC, nothing for ECB. data_length_ is   *
+   * the bytes in between, which are split into chunks: the padded text  *
+   * for ECB and CBC, the text itself for CTR.                           */
+  uint32_t in_header_, out_header_;
+  uint64_t data_length_;
+
+  /* CTR and CBC: the nonce of the file. CTR: keystream generated ahead  *
+   * into a second ring of the same geometry as buffer_. Each work item  *
+   * of a slot has a count of its two halves, keystream and data, that   *
+   * are ready; whichever arrives second XORs them.                      *
+   * keystream_in_flight_ counts the keystream items not yet finished.   */
+  uint64_t nonce_;
+  uint8_t *keystream_;
+  std::atomic<uint8_t> *item_parts_;
+  uint32_t items_per_chunk_;
+  std::atomic<uint32_t> keystream_in_flight_;
+
+  /* Bytes of the running file read and written so far, and blocks *
+   * encrypted or decrypted since the session was made, which is   *
+   * sampled for progress.                                         */
+  std::atomic<uint64_t> read_length_, write_length_;
+  std::atomic<uint64_t> num_operations_;
+
+  /* Counters for stats, kept across files until reset_stats. The     *
+   * clock and the pool's lock wait are taken at the reset, so that   *
+   * stats reports the difference.                                    */
+  uint64_t stats_start_ns_, stats_lock_wait_ns_;
+  std::atomic<uint64_t> total_read_, total_written_;
+  std::atomic<uint64_t> read_ns_, cipher_ns_, write_ns_;
+  std::atomic<uint64_t> read_wait_ns_, write_wait_ns_;
+  std::atomic<uint64_t> num_items_;
+  LatencyHistogram latency_;
+
+  /* Count a work item of cipher work that began at start_ns */
+  void count_item(uint64_t start_ns);
+
+  /* Count a finished work item of chunk, and wake the writer if it was *
+   * the chunk's last                                                   */
+  void finish_item(chunk_descriptor *chunk);
+
+  void crypt_blocks(uint8_t *out, const uint8_t *in, uint64_t num_blocks,
+                    int mode) const;
+
+  void cbc_ivs(uint8_t *ivs, uint64_t nonce, uint64_t first_segment,
+               uint64_t num_segments) const;
+
+  void cbc_encrypt(uint8_t *out, const uint8_t *in, uint64_t num_blocks,
+                   uint64_t nonce, uint64_t first_segment) const;
+
+  void cbc_decrypt(uint8_t *out, const uint8_t *in, uint64_t num_blocks,
+                   uint64_t nonce, uint64_t first_segment) const;
+
+  void init_layout(int mode, const std::string &in_name);
+
+  uint32_t read_stream(uint8_t *data, uint32_t num_bytes, bool *end);
+
+  uint32_t read_chunk(int mode, uint8_t *data);
+
+  void read_task(uint8_t *data, uint64_t offset, uint32_t num_bytes);
+
+  void write_task(uint8_t *data, uint64_t offset, uint32_t num_bytes);
+
+  void encrypt_task(chunk_descriptor *chunk, uint32_t offset,
+                    uint32_t num_blocks);
+
+  void decrypt_task(chunk_descriptor *chunk, uint32_t offset,
+                    uint32_t num_blocks);
+
+  void ctr_xor_task(chunk_descriptor *chunk, const uint8_t *chunk_keystream,
+                    uint32_t item);
+
+  void ctr_keystream_ahead(chunk_descriptor *chunk, uint32_t num_bytes);
+
+  void read_ahead(int mode, ChunkRing *ring);
+
+  void alloc_buffers();
+
+  void run_buffered(int mode, const std::string &in_name);
+
+  void map_task(uint8_t *out, const uint8_t *in, uint64_t num_blocks,
+                int mode);
+
+  void cbc_map_task(uint8_t *out, const uint8_t *in, uint64_t num_blocks,
+                    uint64_t nonce, uint64_t first_segment, int mode);
+
+  void ctr_map_task(uint8_t *out, const uint8_t *in, uint64_t num_bytes,
+                    uint64_t nonce, uint64_t first_block);
+
+  void span_item(data_span *span, size_t item);
+
+  void crypt_span(int mode, uint8_t *out, const uint8_t *in, uint64_t length,
+                  uint64_t nonce);
+
+  bool run_mapped(int mode, const std::string &in_name);
+
+  double time_configuration(FILE *sample, FILE *scratch);
+
+  Session(const Session &);
+  Session &operator=(const Session &);
+};
+
+#endif  // SESSION_H_
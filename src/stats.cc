@@ -0,0 +1,192 @@
+/*
+ *  Copyright (C) 2019 Zachary Mohling
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "stats.h"
+
+#include <sys/resource.h>
+
+#include <stdint.h>
+#include <stdio.h>
+
+/* Bucket of a latency: below 2^LATENCY_SUB_BITS one per nanosecond,   *
+ * above it the leading bit picks the power of two and the bits after  *
+ * it the step within.                                                 */
+static unsigned latency_bucket(uint64_t ns) {
+  if (ns < (1u << LATENCY_SUB_BITS)) return (unsigned)ns;
+
+  unsigned msb = 63 - __builtin_clzll(ns);
+  unsigned shift = msb - LATENCY_SUB_BITS;
+  unsigned step = (ns >> shift) & ((1u << LATENCY_SUB_BITS) - 1);
+
+  return ((shift + 1) << LATENCY_SUB_BITS) + step;
+}
+
+/* Largest latency that falls in bucket */
+static uint64_t bucket_upper_bound(unsigned bucket) {
+  if (bucket < (1u << LATENCY_SUB_BITS)) return bucket;
+
+  unsigned shift = (bucket >> LATENCY_SUB_BITS) - 1;
+  uint64_t step = bucket & ((1u << LATENCY_SUB_BITS) - 1);
+  uint64_t lower = (((uint64_t)1 << LATENCY_SUB_BITS) + step) << shift;
+
+  return lower + (((uint64_t)1 << shift) - 1);
+}
+
+LatencyHistogram::LatencyHistogram() { reset(); }
+
+void LatencyHistogram::record(uint64_t ns) {
+  buckets_[latency_bucket(ns)].fetch_add(1, std::memory_order_relaxed);
+  count_.fetch_add(1, std::memory_order_relaxed);
+
+  uint64_t seen = max_.load(std::memory_order_relaxed);
+  while (ns > seen &&
+         !max_.compare_exchange_weak(seen, ns, std::memory_order_relaxed)) {
+  }
+}
+
+void LatencyHistogram::reset() {
+  unsigned bucket;
+  for (bucket = 0; bucket < LATENCY_BUCKETS; bucket++) {
+    buckets_[bucket].store(0, std::memory_order_relaxed);
+  }
+  count_.store(0, std::memory_order_relaxed);
+  max_.store(0, std::memory_order_relaxed);
+}
+
+uint64_t LatencyHistogram::count() const {
+  return count_.load(std::memory_order_relaxed);
+}
+
+uint64_t LatencyHistogram::percentile(double fraction) const {
+  uint64_t total = count();
+  if (total == 0) return 0;
+
+  uint64_t rank = (uint64_t)(fraction * total + 0.5);
+  if (rank < 1) rank = 1;
+  if (rank > total) rank = total;
+
+  uint64_t seen = 0;
+  unsigned bucket;
+  for (bucket = 0; bucket < LATENCY_BUCKETS; bucket++) {
+    seen += buckets_[bucket].load(std::memory_order_relaxed);
+    if (seen >= rank) break;
+  }
+
+  /* The top bucket is bounded by the largest latency seen */
+  uint64_t bound = bucket_upper_bound(bucket);
+  return bound < max() ? bound : max();
+}
+
+uint64_t LatencyHistogram::max() const {
+  return max_.load(std::memory_order_relaxed);
+}
+
+/* ru_maxrss is in kilobytes on Linux and in bytes on macOS */
+uint64_t peak_memory_bytes() {
+  struct rusage usage;
+  if (getrusage(RUSAGE_SELF, &usage) != 0) return 0;
+
+#if defined(__APPLE__)
+  return (uint64_t)usage.ru_maxrss;
+#else
+  return (uint64_t)usage.ru_maxrss * 1024;
+#endif
+}
+
+double stats_utilization(const pipeline_stats *stats) {
+  if (stats->wall_ns == 0 || stats->num_workers == 0) return 0;
+
+  double busy = (double)stats->cipher_ns /
+                ((double)stats->wall_ns * stats->num_workers);
+  return busy < 1 ? busy : 1;
+}
+
+static double seconds(uint64_t ns) { return ns / 1e9; }
+
+static double milliseconds(uint64_t ns) { return ns / 1e6; }
+
+static void print_stats_text(const pipeline_stats *stats, FILE *file) {
+  double wall = seconds(stats->wall_ns);
+  double rate = wall > 0 ? stats->bytes_read / wall / (1024 * 1024) : 0;
+
+  fprintf(file, "Pipeline statistics\n");
+  fprintf(file, "  wall time       %10.3f s\n", wall);
+  fprintf(file, "  workers         %10u (%.1f%% busy)\n", stats->num_workers,
+          100 * stats_utilization(stats));
+  fprintf(file, "  bytes read      %10llu (%.1f MB/s)\n",
+          (unsigned long long)stats->bytes_read, rate);
+  fprintf(file, "  bytes written   %10llu\n",
+          (unsigned long long)stats->bytes_written);
+  fprintf(file, "  read time       %10.3f s\n", seconds(stats->read_ns));
+  fprintf(file, "  cipher time     %10.3f s\n", seconds(stats->cipher_ns));
+  fprintf(file, "  write time      %10.3f s\n", seconds(stats->write_ns));
+  fprintf(file, "  reader waiting  %10.3f s\n", seconds(stats->read_wait_ns));
+  fprintf(file, "  writer waiting  %10.3f s\n",
+          seconds(stats->write_wait_ns));
+  fprintf(file, "  lock waiting    %10.3f s\n", seconds(stats->lock_wait_ns));
+  fprintf(file, "  work items      %10llu\n",
+          (unsigned long long)stats->num_items);
+  fprintf(file, "  chunks          %10llu\n",
+          (unsigned long long)stats->num_chunks);
+  fprintf(file,
+          "  chunk latency   p50 %.3f ms, p90 %.3f ms, p99 %.3f ms, "
+          "max %.3f ms\n",
+          milliseconds(stats->latency_p50_ns),
+          milliseconds(stats->latency_p90_ns),
+          milliseconds(stats->latency_p99_ns),
+          milliseconds(stats->latency_max_ns));
+  fprintf(file, "  buffer memory   %10llu bytes\n",
+          (unsigned long long)stats->buffer_bytes);
+  fprintf(file, "  peak memory     %10llu bytes\n",
+          (unsigned long long)stats->peak_memory_bytes);
+}
+
+static void print_stats_json(const pipeline_stats *stats, FILE *file) {
+  fprintf(file,
+          "{\"wall_ns\": %llu, \"workers\": %u, \"bytes_read\": %llu, "
+          "\"bytes_written\": %llu, \"read_ns\": %llu, \"cipher_ns\": %llu, "
+          "\"write_ns\": %llu, \"read_wait_ns\": %llu, "
+          "\"write_wait_ns\": %llu, \"lock_wait_ns\": %llu, "
+          "\"utilization\": %.4f, \"work_items\": %llu, \"chunks\": %llu, "
+          "\"latency_ns\": {\"p50\": %llu, \"p90\": %llu, \"p99\": %llu, "
+          "\"max\": %llu}, \"buffer_bytes\": %llu, "
+          "\"peak_memory_bytes\": %llu}\n",
+          (unsigned long long)stats->wall_ns, stats->num_workers,
+          (unsigned long long)stats->bytes_read,
+          (unsigned long long)stats->bytes_written,
+          (unsigned long long)stats->read_ns,
+          (unsigned long long)stats->cipher_ns,
+          (unsigned long long)stats->write_ns,
+          (unsigned long long)stats->read_wait_ns,
+          (unsigned long long)stats->write_wait_ns,
+          (unsigned long long)stats->lock_wait_ns, stats_utilization(stats),
+          (unsigned long long)stats->num_items,
+          (unsigned long long)stats->num_chunks,
+          (unsigned long long)stats->latency_p50_ns,
+          (unsigned long long)stats->latency_p90_ns,
+          (unsigned long long)stats->latency_p99_ns,
+          (unsigned long long)stats->latency_max_ns,
+          (unsigned long long)stats->buffer_bytes,
+          (unsigned long long)stats->peak_memory_bytes);
+}
+
+void print_stats(const pipeline_stats *stats, FILE *file, int format) {
+  if (format == STATS_JSON)
+    print_stats_json(stats, file);
+  else if (format == STATS_TEXT)
+    print_stats_text(stats, file);
+}
@@ -0,0 +1,102 @@
+/*
+ *  Copyright (C) 2019 Zachary Mohling
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef STATS_H_
+#define STATS_H_
+
+#include <stdint.h>
+#include <stdio.h>
+
+#include <atomic>
+#include <chrono>
+
+/* What --stats prints when the job finishes: nothing, a table for a   *
+ * person to read, or one JSON object.                                  */
+#define STATS_NONE 0
+#define STATS_TEXT 1
+#define STATS_JSON 2
+
+/* Buckets of the latency histogram. Every power of two is split into *
+ * 2^LATENCY_SUB_BITS linear steps, so a percentile is off by at most  *
+ * an eighth of its value.                                             */
+#define LATENCY_SUB_BITS 3
+#define LATENCY_BUCKETS (64 << LATENCY_SUB_BITS)
+
+/* Nanoseconds on a monotonic clock, for timing the stages */
+inline uint64_t stats_now_ns() {
+  return std::chrono::duration_cast<std::chrono::nanoseconds>(
+             std::chrono::steady_clock::now().time_since_epoch())
+      .count();
+}
+
+/* Histogram of latencies in nanoseconds, recorded from any thread.     *
+ * Only counts are kept, so recording never allocates or locks.         */
+class LatencyHistogram {
+ public:
+  LatencyHistogram();
+
+  void record(uint64_t ns);
+
+  void reset();
+
+  uint64_t count() const;
+
+  /* Latency below which fraction of the records fall, to the upper *
+   * bound of its bucket. 0 if nothing was recorded.                */
+  uint64_t percentile(double fraction) const;
+
+  uint64_t max() const;
+
+ private:
+  std::atomic<uint64_t> buckets_[LATENCY_BUCKETS];
+  std::atomic<uint64_t> count_, max_;
+
+  LatencyHistogram(const LatencyHistogram &);
+  LatencyHistogram &operator=(const LatencyHistogram &);
+};
+
+/* Counters of a session's pipeline since its stats were last reset.    *
+ * Times are in nanoseconds. read_ns and write_ns are spent in reads    *
+ * and writes of the buffered pipeline; memory-mapped files are read    *
+ * and written by page faults inside the cipher work instead.           *
+ * read_wait_ns is the reader waiting for a free slot of the ring, and  *
+ * write_wait_ns the writer waiting for the next chunk to finish, or    *
+ * the caller of a mapped run for its work items. lock_wait_ns is time  *
+ * spent blocked on the thread pool's queue locks. A chunk is a chunk   *
+ * of the ring, or a work item of a mapped file or buffer; its latency  *
+ * runs from the start of its read to the end of its write.             */
+typedef struct pipeline_stats {
+  uint64_t wall_ns;
+  unsigned num_workers;
+  uint64_t bytes_read, bytes_written;
+  uint64_t read_ns, cipher_ns, write_ns;
+  uint64_t read_wait_ns, write_wait_ns, lock_wait_ns;
+  uint64_t num_chunks, num_items;
+  uint64_t latency_p50_ns, latency_p90_ns, latency_p99_ns, latency_max_ns;
+  uint64_t buffer_bytes, peak_memory_bytes;
+} pipeline_stats;
+
+/* Peak resident memory of the process in bytes */
+uint64_t peak_memory_bytes();
+
+/* Fraction of the workers' time spent on cipher work, from 0 to 1 */
+double stats_utilization(const pipeline_stats *stats);
+
+/* Print stats to file in format, STATS_TEXT or STATS_JSON */
+void print_stats(const pipeline_stats *stats, FILE *file, int format);
+
+#endif  // STATS_H_
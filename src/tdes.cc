@@ -17,320 +17,486 @@
 
 #include "tdes.h"
 
-#include <chrono>
-#include <map>
-#include <mutex>
-#include <queue>
-#include <thread>
+#include <sys/stat.h>
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <algorithm>
+#include <atomic>
+#include <functional>
+#include <memory>
 #include <vector>
 
 #include "../lib/ThreadPool.h"
-#include "cipher.h"
+#include "agent.h"
+#include "cpu_limits.h"
 #include "io.h"
-#include "key_generator.h"
+#include "modes.h"
+#include "progress.h"
+
+/* State of a batch run shared by the small file tasks. length is the *
+ * bytes of input in all files. Each small file in flight holds one   *
+ * slot of slots: an input half and an output half of slot_size bytes *
+ * each.                                                              */
+typedef struct batch_state {
+  Session *session;
+  ThreadPool *pool;
+  int mode;
+  uint64_t length;
+  uint8_t *slots;
+  uint32_t slot_size;
+  std::unique_ptr<std::atomic<bool>[]> slot_free;
+} batch_state;
+
+/* Progress of a run, a file or a whole batch: the bytes through the *
+ * session's cipher, sampled by the reporter's thread                 */
+static uint64_t session_progress(void *arg) {
+  return ((const Session *)arg)->bytes_done();
+}
 
-static std::mutex queue_mtx;
-static std::mutex map_mtx;
+/* Report progress of total bytes as a bar on a terminal, and as lines *
+ * of key=value pairs when notices go to a file or pipe                */
+static ProgressReporter *start_progress(Session *session, uint64_t total,
+                                        int mode) {
+  ProgressReporter *reporter =
+      new ProgressReporter(session_progress, session, total, mode, ui,
+                           ui_is_terminal() ? PROGRESS_BAR : PROGRESS_LINES);
+  reporter->start();
+  return reporter;
+}
 
-/* DES Cipher */
-static Cipher cipher;
+/* Fetch the keys from a running tdes-agent, or derive them from the  *
+ * user's password, and load them into the session.                   */
+static void setup_keys(Session *session, int mode) {
+  key_schedule K1, K2, K3;
 
-/* DES Key Generator */
-static KeyGenerator keygen;
+  if (!agent_fetch_keys(&K1, &K2, &K3)) init_keys(&K1, &K2, &K3, mode);
 
-/* Subkeys of the 3 keys */
-static uint8_t K1[16][6], K2[16][6], K3[16][6];
+  session->set_keys(&K1, &K2, &K3);
 
-/* File pointers to our source and destination files */
-static FILE *in_file, *out_file;
+  OPENSSL_cleanse(&K1, sizeof(K1));
+  OPENSSL_cleanse(&K2, sizeof(K2));
+  OPENSSL_cleanse(&K3, sizeof(K3));
+}
 
-/* Circular buffer */
-static uint8_t *buffer;
+/* Settle the worker count, chunk size and ring depth from the options. *
+ * file_length bounds the chunks the autotuner tries.                   */
+static tdes_options size_pipeline(const tdes_options *options,
+                                  uint64_t file_length) {
+  tdes_options sized = *options;
 
-/* Pointers which point to a chunk of data in buffer. R points to the *
- * next chunk to read data into from disk, while W points to the next *
- * chunk which to read from the buffer and write to disk.             */
-static uint32_t R = 0, W = 0;
+  /* The CPUs threads are pinned to, or all the process may use */
+  unsigned cpus = options->num_pin_cpus;
+  if (!cpus) cpus = available_cpus();
 
-static uint64_t in_file_length, out_file_length, read_length, write_length;
-static uint64_t num_operations;
+  if (options->autotune) Session::autotune(options, cpus, file_length, &sized);
 
-/* Queue of pointers to 8-byte blocks to be encrypted/decrypted. Queue*
- * gets populated by the read_task.                                   */
-static std::priority_queue<uint8_t *> read_queue;
+  /* A worker for every CPU unless told otherwise. The reader and writer *
+   * sleep while they wait, so they need no CPU of their own.            */
+  if (!sized.num_workers) sized.num_workers = cpus;
 
-/* Map of pointer-to-chunk keys, will value struct that accounts for *
- * the numbers of jobs (encrypting a block) to complete and callback *
- * for a block in the chunk. When callback_container.num_callbacks ==*
- * callback_container.num_expected_callbacks, entry will be erased   *
- * from the map, and the chunk will be written to disk.              */
-static std::map<uint8_t *, callback_container> write_map;
+  return sized;
+}
 
-/* Add padding the last block of the file. To PKCS#5 specification.  */
-static void add_PKCS5_padding(uint8_t *block) {
-  uint8_t i, PKCS5_PADDING = 8 - (in_file_length % 8);
-  for (i = 0; i < PKCS5_PADDING; i++) {
-    block[(8 - PKCS5_PADDING) + i] = PKCS5_PADDING;
-  }
+/* Tasks each worker's deque holds, ThreadPool's default */
+#define POOL_QUEUE_CAPACITY 256
+
+/* Pins each worker of the pool to its CPU of the options' list, if any */
+static std::function<void(size_t)> worker_pinning(const tdes_options *sized) {
+  if (!sized->num_pin_cpus) return nullptr;
+
+  const unsigned *cpus = sized->pin_cpus;
+  unsigned num_cpus = sized->num_pin_cpus;
+  return [cpus, num_cpus](size_t worker) {
+    pin_thread(cpus, num_cpus, worker);
+  };
 }
 
-/* Averages lengths and counters and calls IO's progress function.  */
-static void update_progress(int mode) {
-  float OPER_WEIGHT = 0.7, READ_WEIGHT = 0.15, WRITE_WEIGHT = 0.15;
+/* Pin the calling thread, which writes the output, after the workers */
+static void pin_writer(const tdes_options *sized) {
+  pin_thread(sized->pin_cpus, sized->num_pin_cpus,
+             sized->num_workers + PIN_WRITER);
+}
+
+/* Report the configuration the autotuner settled on */
+static void autotune_notice(const tdes_options *sized,
+                            const Session *session) {
+  if (!sized->autotune) return;
+
+  *ui << "Autotune: " << sized->num_workers << " workers, "
+      << session->chunk_size() / 1024 << " KB chunks, ring depth "
+      << session->ring_depth() << std::endl;
+}
 
-  float percentage =
-      (OPER_WEIGHT * ((float)num_operations /
-                      ((float)in_file_length / (float)BLOCK_SIZE)) +
-       READ_WEIGHT * ((float)read_length / (float)in_file_length) +
-       WRITE_WEIGHT * ((float)write_length / (float)out_file_length));
+/* Print the session's counters to stderr, if the options ask for them */
+static void report_stats(const tdes_options *options,
+                         const Session *session) {
+  if (options->stats == STATS_NONE) return;
 
-  print_progress(percentage * 100.0, mode);
+  pipeline_stats stats;
+  session->stats(&stats);
+  print_stats(&stats, stderr, options->stats);
 }
 
 /* Driving function. Calls IO functions to derive keys from user's    *
- * password, opens files, allocates buffer. Contains loop for reading *
- * in data, adding jobs to the thread pool, and writing data.         */
-void run(int mode, std::string *in_file_name, std::string *out_file_name) {
+ * password, opens files, and hands them to a session, which reads,   *
+ * encrypts or decrypts, and writes them on a thread pool.            */
+void run(int mode, std::string *in_file_name, std::string *out_file_name,
+         const tdes_options *options) {
+  FILE *in_file, *out_file;
+  uint64_t in_file_length;
+
+  bool in_streaming = (*in_file_name == "-");
+  bool out_streaming = (*out_file_name == "-");
+
   open_file(&in_file, *in_file_name, "rb", &in_file_length);
-  open_file(&out_file, *out_file_name, "wb", NULL);
+  open_file(&out_file, *out_file_name, "w+b", NULL);
+
+  use_terminal(in_streaming, out_streaming);
 
   startup_notice();
 
-  init_keys(&keygen, K1, K2, K3, mode);
+  tdes_options sized =
+      size_pipeline(options, in_streaming ? UINT64_MAX : in_file_length);
+
+  /* Thread pool for encryption and decryption operations */
+  ThreadPool pool(sized.num_workers, POOL_QUEUE_CAPACITY,
+                  worker_pinning(&sized));
+  pin_writer(&sized);
+
+  Session session(&sized, &pool);
+
+  setup_keys(&session, mode);
+
+  autotune_notice(&sized, &session);
 
-  /* Benchmarking */
-  // auto benchmark_start = std::chrono::high_resolution_clock::now();
+  session.reset_stats();
+
+  std::unique_ptr<ProgressReporter> progress(
+      start_progress(&session, in_streaming ? 0 : in_file_length, mode));
+
+  session.crypt_file(mode, in_file, in_streaming, out_file, out_streaming,
+                     *in_file_name);
+
+  progress->stop();
+
+  report_stats(&sized, &session);
+
+  fclose(in_file);
 
-  print_progress(0, mode);
+  fclose(out_file);
+}
 
-  /* Adjust write_length if encrypting for padding */
-  if (mode == 0) {
-    /* round to even 8-byte block size */
-    out_file_length =
-        in_file_length + (BLOCK_SIZE - (in_file_length % BLOCK_SIZE));
-  } else {
-    out_file_length = in_file_length;
+/* Add source to the batch: a regular file as out_dir/<its name>, a     *
+ * directory as the tree of regular files under out_dir/<its name>.     *
+ * Output directories are listed in out_dirs, parents first, to be made *
+ * once the whole batch has been listed.                                */
+static void list_batch(const std::string &source, const std::string &out_dir,
+                       std::vector<batch_file> *files,
+                       std::vector<std::string> *out_dirs) {
+  std::string name = source;
+  while (name.size() > 1 && name[name.size() - 1] == '/') {
+    name.erase(name.size() - 1);
   }
+  size_t slash = name.find_last_of('/');
+  if (slash != std::string::npos) name = name.substr(slash + 1);
 
-  /* Allocate memory for our 16-chunk, 2^16 bit circular buffer */
-  if (!(buffer =
-            (uint8_t *)malloc(BUFFER_SIZE * NUM_BUFFERS * sizeof(uint8_t)))) {
-    fprintf(stderr, "Insufficient memory. ERROR: %d\n", errno);
+  std::string out_path = out_dir + "/" + name;
+
+  struct stat source_stat;
+  if (stat(source.c_str(), &source_stat) != 0) {
+    fprintf(stderr, "Could not open file %s. ERROR: %d\n", source.c_str(),
+            errno);
     exit(-1);
   }
 
-  /* Thread pool for encryption and decryption operations */
-  unsigned num_threads = std::thread::hardware_concurrency();
-  if (num_threads == 0) num_threads = 4;
-  ThreadPool pool(num_threads - 1);
-
-  static int init = 0;
-  while (true) {
-    if (((R % 16) != (W % 16) && (read_length < in_file_length)) || !init) {
-      init = 1;
-
-      uint32_t start_byte = ((R % NUM_BUFFERS) * BUFFER_SIZE);
-      uint32_t end_byte = ((R * BUFFER_SIZE) + BUFFER_SIZE > out_file_length)
-                              ? start_byte + (out_file_length % BUFFER_SIZE)
-                              : start_byte + BUFFER_SIZE;
-
-      /* Utilize thread pool for reading to save on thread-creation costs */
-      auto read = pool.enqueue(read_task, buffer + start_byte,
-                               (uint32_t)(end_byte - start_byte));
-      read.get();
-
-      /* Add callback container. Expected callbacks is equal to the number *
-       * of threads we'll spawn for this chunk. (BUFFER_SIZE / 8)          */
-      callback_container c;
-      c.num_callbacks = 0;
-      c.num_expected_callbacks =
-          (uint32_t)(((end_byte - start_byte) - 1) / BLOCK_SIZE +
-                     1);  // round-up integer division
-
-      /* Add padding to last block of file. This padding ensures that the *
-       * total new file length will evenly divide into BLOCK_SIZE. Padding*
-       * is to PKCS#5 specification.                                      */
-      if ((out_file_length - (R * BUFFER_SIZE) < BUFFER_SIZE) && mode == 0) {
-        add_PKCS5_padding(buffer + start_byte +
-                          ((c.num_expected_callbacks - 1) * BLOCK_SIZE));
-      }
-
-      /* Add pointer to chunk and callback to map */
-      write_map[buffer + start_byte] = c;
-
-      R++;
-
-      read_length += (uint32_t)(end_byte - start_byte);
+  if (S_ISREG(source_stat.st_mode)) {
+    /* Refuse to write over a source, whatever path names it */
+    struct stat out_stat;
+    if (stat(out_path.c_str(), &out_stat) == 0 &&
+        out_stat.st_dev == source_stat.st_dev &&
+        out_stat.st_ino == source_stat.st_ino) {
+      fprintf(stderr, "Aborting. Refusing to overwrite original file: %s\n",
+              source.c_str());
+      exit(-1);
     }
 
-    /* Add any queued pointers (to a 8-byte block in buffer) to threadpool *
-     * job queue.                                                          */
-    while (!read_queue.empty()) {
-      if (mode == 0)
-        pool.enqueue(encrypt_task, read_queue.top());
-      else
-        pool.enqueue(decrypt_task, read_queue.top());
+    batch_file file = {source, out_path, (uint64_t)source_stat.st_size};
+    files->push_back(file);
+    return;
+  }
 
-      read_queue.pop();
-    }
+  if (!S_ISDIR(source_stat.st_mode)) return;
 
-    /* Check if threads spawned for encryting/decrypting chunk W have all *
-     * completed by ensuring num_callbacks == num_expected_callbacks. If  *
-     * so, write completed chunk W to disk. If decrypting, change         *
-     * num_bytes to reflect de-padding the last 8-byte block.             */
+  DIR *dir = opendir(source.c_str());
+  if (!dir) {
+    fprintf(stderr, "Could not open directory %s. ERROR: %d\n",
+            source.c_str(), errno);
+    exit(-1);
+  }
 
-    callback_container callback =
-        write_map[&buffer[(W % NUM_BUFFERS) * BUFFER_SIZE]];
+  out_dirs->push_back(out_path);
 
-    if (callback.num_callbacks == callback.num_expected_callbacks) {
-      uint32_t num_bytes = callback.num_expected_callbacks * 8;
+  std::vector<std::string> entries;
+  struct dirent *entry;
+  while ((entry = readdir(dir)) != NULL) {
+    if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0)
+      continue;
+    entries.push_back(source + "/" + entry->d_name);
+  }
+  closedir(dir);
 
-      /* If last block, de-pad by shortening the length of the write     *
-       * operation.                                                      */
-      if (((W * BUFFER_SIZE) + num_bytes == out_file_length) && mode == 1) {
-        num_bytes -= buffer[(in_file_length % (BUFFER_SIZE * NUM_BUFFERS)) - 1];
-      }
+  std::sort(entries.begin(), entries.end());
 
-      /* Utilize thread pool for writing to save on thread-creation costs*/
-      auto write = pool.enqueue(
-          write_task, buffer + ((W % NUM_BUFFERS) * BUFFER_SIZE), num_bytes);
-      write.get();
+  size_t i;
+  for (i = 0; i < entries.size(); i++) {
+    list_batch(entries[i], out_path, files, out_dirs);
+  }
+}
 
-      W++;
+/* Batch: run a whole small file on a worker, through slot slot. The   *
+ * file is read into the slot's input half, run through the session    *
+ * into its output half, and written out, the slot being marked free   *
+ * again at the end.                                                   */
+static void small_file_task(const batch_file *file, uint32_t slot,
+                            batch_state *batch) {
+  uint8_t *in = batch->slots + ((size_t)slot * 2 * batch->slot_size);
+  uint8_t *out = in + batch->slot_size;
+
+  int in_fd = open(file->in_path.c_str(), O_RDONLY);
+  if (in_fd < 0) {
+    fprintf(stderr, "Could not open file %s. ERROR: %d\n",
+            file->in_path.c_str(), errno);
+    exit(-1);
+  }
 
-      write_length += num_bytes;
+  /* The slot and the progress total were sized from the listing, so a *
+   * file that has changed since is an error, not a short read or a    *
+   * silently truncated output.                                        */
+  struct stat in_stat;
+  if (fstat(in_fd, &in_stat) != 0) {
+    fprintf(stderr, "Error: could not stat %s. %s.\n", file->in_path.c_str(),
+            strerror(errno));
+    exit(-7);
+  }
+  uint64_t length = in_stat.st_size;
+  if (length != file->length) {
+    fprintf(stderr, "Error: %s changed size during the batch.\n",
+            file->in_path.c_str());
+    exit(-7);
+  }
 
-      /* If reading has stopped, W (write) will eventually catch-up to   *
-       * R (read) location. That means we're done.                       */
-      if (W == R) break;
+  uint64_t done = 0;
+  while (done < length) {
+    ssize_t n = pread(in_fd, in + done, length - done, done);
+    if (n < 0 && errno == EINTR) continue;
+    if (n == 0) {
+      fprintf(stderr, "Error: %s changed size during the batch.\n",
+              file->in_path.c_str());
+      exit(-7);
+    }
+    if (n < 0) {
+      fprintf(stderr, "Error: could not read %s. %s.\n", file->in_path.c_str(),
+              strerror(errno));
+      exit(-7);
     }
+    done += n;
+  }
+  close(in_fd);
+
+  uint64_t out_length;
+  if (!batch->session->crypt_buffer(batch->mode, in, length, out,
+                                    &out_length)) {
+    if (batch->mode == 0) {
+      fprintf(stderr, "Could not generate a nonce.\n");
+    } else {
+      fprintf(stderr, "Aborting. %s is not an encrypted file.\n",
+              file->in_path.c_str());
+    }
+    exit(-1);
+  }
+
+  int out_fd = open(file->out_path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0666);
+  if (out_fd < 0) {
+    fprintf(stderr, "Could not open file %s. ERROR: %d\n",
+            file->out_path.c_str(), errno);
+    exit(-1);
+  }
 
-    update_progress(mode);
+  done = 0;
+  while (done < out_length) {
+    ssize_t n = pwrite(out_fd, out + done, out_length - done, done);
+    if (n < 0 && errno == EINTR) continue;
+    if (n <= 0) {
+      fprintf(stderr, "Error: could not write %s. %s.\n",
+              file->out_path.c_str(), strerror(errno));
+      exit(-7);
+    }
+    done += n;
   }
+  close(out_fd);
 
-  print_progress(100, mode);
+  ThreadPool *pool = batch->pool;
+  batch->slot_free[slot].store(true, std::memory_order_release);
+  pool->notify_waiters();
+}
 
-  free(buffer);
+/* Batch: keep up to ring_depth small files in flight on the pool, one *
+ * per slot.                                                           */
+static void run_small_files(const std::vector<batch_file *> &files,
+                            batch_state *batch, ThreadPool *pool) {
+  uint32_t num_slots = batch->session->ring_depth();
+  batch->slot_size = batch->session->chunk_size();
 
-  fclose(in_file);
+  if (posix_memalign((void **)&batch->slots, CACHE_LINE_SIZE,
+                     (size_t)num_slots * 2 * batch->slot_size) != 0) {
+    fprintf(stderr, "Insufficient memory. ERROR: %d\n", errno);
+    exit(-1);
+  }
 
-  fclose(out_file);
+  batch->slot_free.reset(new std::atomic<bool>[num_slots]);
 
-  /* Benchmarking */
-  /*
-  auto benchmark_end = std::chrono::high_resolution_clock::now();
-  double elapsed_milliseconds =
-      std::chrono::duration<double, std::milli>(benchmark_end -
-  benchmark_start).count(); double bytes_per_second =
-      ((double)in_file_length) / (elapsed_milliseconds / 1000.0);
-  std::cout << bytes_per_second << " bytes/second" << std::endl;
-  */
-}
+  uint32_t slot;
+  for (slot = 0; slot < num_slots; slot++) batch->slot_free[slot] = true;
 
-/* Initialize set of keys for Triple DES. Derives the cumulative 24    *
- * bytes from user's password.                                         */
-void init_keys(KeyGenerator *keygen, uint8_t K1[16][6], uint8_t K2[16][6],
-               uint8_t K3[16][6], int mode) {
-  std::string password;
+  /* Sleep until a task frees a slot */
+  auto any_free = [batch, num_slots] {
+    uint32_t slot;
+    for (slot = 0; slot < num_slots; slot++) {
+      if (batch->slot_free[slot].load(std::memory_order_acquire)) return true;
+    }
+    return false;
+  };
 
-  prompt_password(&password, mode);
+  size_t i = 0;
+  while (i < files.size()) {
+    pool->wait_until(any_free);
 
-  uint8_t K[24];
+    for (slot = 0; slot < num_slots && i < files.size(); slot++) {
+      if (!batch->slot_free[slot].load(std::memory_order_acquire)) continue;
 
-  /* Derive key from password using PBKDF2 with SHA512 */
-  if (!(PKCS5_PBKDF2_HMAC(password.c_str(), password.length(), NULL, 0, 100000,
-                          EVP_sha512(), 24, K))) {
-    fprintf(stderr, "Error while deriving key from password. ERROR: %d", errno);
-    exit(-1);
+      batch->slot_free[slot].store(false, std::memory_order_relaxed);
+      pool->submit(small_file_task, files[i++], slot, batch);
+    }
+  }
+
+  for (slot = 0; slot < num_slots; slot++) {
+    pool->wait_until([batch, slot] {
+      return batch->slot_free[slot].load(std::memory_order_acquire);
+    });
   }
 
-  /* Generate set of 16 subkeys from the set of 8-byte keys */
-  keygen->generate(K, K1);
-  keygen->generate(K + 8, K2);
-  keygen->generate(K + 16, K3);
+  OPENSSL_cleanse(batch->slots, (size_t)num_slots * 2 * batch->slot_size);
+  free(batch->slots);
 }
 
-/* Read a chunk into the circular buffer. For each block read, add a     *
- * pointer to the read_queue.                                            */
-void read_task(uint8_t *buffer, uint32_t num_bytes) {
-  /* Bounds checking */
-  int read_size;
-  if (read_length + num_bytes <= in_file_length) {
-    read_size = num_bytes;
-  } else {
-    read_size = in_file_length - read_length;
+/* Batch driving function. Lists every file, derives the keys and sizes *
+ * the pool and session once, then runs the files that span more than a *
+ * chunk one at a time through the session's pipeline and the rest many *
+ * at once.                                                             */
+void run_batch(int mode, std::vector<std::string> *sources,
+               std::string *out_dir, const tdes_options *options) {
+  std::vector<batch_file> files;
+  std::vector<std::string> out_dirs;
+
+  size_t i;
+  for (i = 0; i < sources->size(); i++) {
+    list_batch((*sources)[i], *out_dir, &files, &out_dirs);
   }
 
-  if (!fread(buffer, read_size, 1, in_file)) {
-    printf("Error: could not read block starting at %llu. %s.\n", read_length,
-           strerror(errno));
-    exit(-7);
+  if (mkdir(out_dir->c_str(), 0777) != 0 && errno != EEXIST) {
+    fprintf(stderr, "Could not create directory %s. ERROR: %d\n",
+            out_dir->c_str(), errno);
+    exit(-1);
+  }
+  for (i = 0; i < out_dirs.size(); i++) {
+    if (mkdir(out_dirs[i].c_str(), 0777) != 0 && errno != EEXIST) {
+      fprintf(stderr, "Could not create directory %s. ERROR: %d\n",
+              out_dirs[i].c_str(), errno);
+      exit(-1);
+    }
   }
 
-  /* Add pointers to each block to read_queue */
-  queue_mtx.lock();
+  use_terminal(false, false);
 
-  uint32_t i = 0;
-  for (i = 0; i < num_bytes; i += 8) {
-    read_queue.push(&buffer[i]);
-  }
+  startup_notice();
 
-  queue_mtx.unlock();
-}
+  /* The autotuner sizes chunks for the largest file */
+  batch_state batch;
+  batch.mode = mode;
+  batch.length = 0;
 
-/* Write a chunk to disk from the cirular queue. On completiion, delete *
- * pointer to that chunk.                                               */
-void write_task(uint8_t *buffer, uint32_t num_bytes) {
-  if (!fwrite(buffer, num_bytes, 1, out_file)) {
-    printf("Error: could not write block starting at %llu. %s.\n", write_length,
-           strerror(errno));
-    exit(-7);
+  uint64_t largest = 0;
+  for (i = 0; i < files.size(); i++) {
+    batch.length += files[i].length;
+    largest = std::max(largest, files[i].length);
   }
 
-  /* Erase chunk-pointer key from write_map */
-  map_mtx.lock();
+  tdes_options sized = size_pipeline(options, largest);
 
-  write_map.erase(buffer);
+  ThreadPool pool(sized.num_workers, POOL_QUEUE_CAPACITY,
+                  worker_pinning(&sized));
+  pin_writer(&sized);
 
-  map_mtx.unlock();
-}
+  Session session(&sized, &pool);
+  batch.session = &session;
+  batch.pool = &pool;
 
-/* Encrypt the block. On completion, remove block from read_queue and *
- * add increment the num_callbacks member of the callback_container   *
- * value of write_map.                                                */
-void encrypt_task(uint8_t *block) {
-  uint8_t T1[8], T2[8];
+  setup_keys(&session, mode);
 
-  cipher.encrypt(T1, block, K1);
-  cipher.decrypt(T2, T1, K2);
-  cipher.encrypt(block, T2, K3);
+  autotune_notice(&sized, &session);
 
-  map_mtx.lock();
+  session.reset_stats();
 
-  write_map[buffer + (((block - buffer) / BUFFER_SIZE) * BUFFER_SIZE)]
-      .num_callbacks++;
+  std::unique_ptr<ProgressReporter> progress(
+      start_progress(&session, batch.length, mode));
+
+  /* A file is small if it goes in and out of one chunk */
+  std::vector<batch_file *> small_files;
+  for (i = 0; i < files.size(); i++) {
+    batch_file *file = &files[i];
+    if (session.max_output_length(file->length) <= session.chunk_size()) {
+      small_files.push_back(file);
+      continue;
+    }
+
+    FILE *in_file, *out_file;
+    uint64_t in_file_length;
+    open_file(&in_file, file->in_path, "rb", &in_file_length);
+    open_file(&out_file, file->out_path, "w+b", NULL);
+
+    session.crypt_file(mode, in_file, false, out_file, false, file->in_path);
+
+    fclose(in_file);
+    fclose(out_file);
+  }
 
-  num_operations++;
+  run_small_files(small_files, &batch, &pool);
 
-  map_mtx.unlock();
+  progress->stop();
+
+  report_stats(&sized, &session);
 }
 
-/* Decrypt the block. On completion, remove block from read_queue and *
- * add increment the num_callbacks member of the callback_container   *
- * value of write_map.                                                */
-void decrypt_task(uint8_t *block) {
-  uint8_t T1[8], T2[8];
+/* Initialize set of keys for Triple DES. Derives the cumulative 24    *
+ * bytes from user's password.                                         */
+void init_keys(key_schedule *K1, key_schedule *K2, key_schedule *K3,
+               int mode) {
+  std::string password;
 
-  cipher.decrypt(T1, block, K3);
-  cipher.encrypt(T2, T1, K2);
-  cipher.decrypt(block, T2, K1);
+  prompt_password(&password, mode);
 
-  map_mtx.lock();
+  uint8_t K[24];
 
-  write_map[buffer + (((block - buffer) / BUFFER_SIZE) * BUFFER_SIZE)]
-      .num_callbacks++;
+  /* Derive key from password using PBKDF2 with SHA512 */
+  if (!(PKCS5_PBKDF2_HMAC(password.c_str(), password.length(), NULL, 0, 100000,
+                          EVP_sha512(), 24, K))) {
+    fprintf(stderr, "Error while deriving key from password. ERROR: %d", errno);
+    exit(-1);
+  }
 
-  num_operations++;
+  Session::expand_key(K, K1, K2, K3);
 
-  map_mtx.unlock();
+  OPENSSL_cleanse(K, sizeof(K));
 }
@@ -18,29 +18,37 @@
 #ifndef TDES_H_
 #define TDES_H_
 
-#include <string>
-
-#include "key_generator.h"
+#include <stdint.h>
 
-#define BUFFER_SIZE 4096
-#define NUM_BUFFERS 16
+#include <string>
+#include <vector>
 
-typedef struct callback_container {
-  uint32_t num_callbacks;
-  uint32_t num_expected_callbacks;
-} callback_container;
+#include "session.h"
 
 /* Driving function. The crypto function accepts the parsed user inputs from *
  * main and applies the DES cryptography algorithm. The process loads bytes  *
- * into a buffer, encrypts or decrypts them, and writes them to a new file. */
-void run(int mode, std::string *in_file_name, std::string *out_file_name);
-
-void encrypt_task(uint8_t *block);
-void decrypt_task(uint8_t *block);
-void read_task(uint8_t *buffer, uint32_t num_bytes);
-void write_task(uint8_t *buffer, uint32_t num_bytes);
-
-void init_keys(KeyGenerator *keygen, uint8_t K1[16][6], uint8_t K2[16][6],
-               uint8_t K3[16][6], int mode);
+ * into a buffer, encrypts or decrypts them, and writes them to a new file. *
+ * With map_files, regular files are memory-mapped instead.                 */
+void run(int mode, std::string *in_file_name, std::string *out_file_name,
+         const tdes_options *options);
+
+/* One file of a batch run: where it is read from and written to, and *
+ * its length in bytes.                                               */
+typedef struct batch_file {
+  std::string in_path;
+  std::string out_path;
+  uint64_t length;
+} batch_file;
+
+/* Batch driving function. Runs every file among sources, and every    *
+ * regular file in the trees of those that are directories, into       *
+ * out_dir under the same names, deriving the keys once and sharing    *
+ * one thread pool and buffer set among all of them.                   */
+void run_batch(int mode, std::vector<std::string> *sources,
+               std::string *out_dir, const tdes_options *options);
+
+/* Derive the keys from the user's password */
+void init_keys(key_schedule *K1, key_schedule *K2, key_schedule *K3,
+               int mode);
 
 #endif  // TDES_H_